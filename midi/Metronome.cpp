@@ -26,6 +26,9 @@ void Metronome::Init(Midi &midi, microseconds_t defer_microseconds/* = 0*/)
 	m_mDefer = defer_microseconds;
 	m_mPrepareMeterPosition = 0;
 
+	m_cDefer.Reset();
+	m_cNow.Reset();
+
 	UpdateMeter(midi);
 
 	m_tlLight = TL_Black;
@@ -351,19 +354,27 @@ void Metronome::UpdateMeter(Midi &midi)
 	unsigned int meter_amount;
 	unsigned int meter_unit;
 
-	midi.GetRealTimeMeter(meter_amount, meter_unit, midi.GetSongPositionInMicroseconds() + m_mDefer);
-	m_mMeterLength = 4 * midi.GetSongRunningTempoMicroseconds(midi.GetSongPositionInMicroseconds() + m_mDefer) / meter_unit;
-	m_mBarLength = 4 * m_mMeterLength * meter_amount / meter_unit;
+	// The beats count transport time, so at other playback rates they
+	// stretch along with the song
+	const PlaybackRate &rate = midi.GetPlaybackRate();
 
-	int bar_id, meter_id;
 	microseconds_t now_time = midi.GetSongPositionInMicroseconds() + m_mDefer;
-	midi.GetSongBarIDAndMeterID(bar_id, meter_id, now_time);
+	m_cDefer.Seek(midi, now_time);
+
+	meter_amount = m_cDefer.MeterAmount();
+	meter_unit = m_cDefer.MeterUnit();
+	m_mMeterLength = rate.SongToTransport(4 * m_cDefer.Tempo() / meter_unit);
+	m_mBarLength = 4 * m_mMeterLength * meter_amount / meter_unit;
+
+	int bar_id = m_cDefer.BarId();
+	int meter_id = m_cDefer.MeterId();
 	microseconds_t position = now_time - midi.GetBarForMeterStartMicroseconds(bar_id, meter_id);
 	if (position > 0)
 	{
 		meter_id++;
 		meter_id %= meter_amount;
 	}
+	position = rate.SongToTransport(position);
 
 	if (m_bSyncMidi && now_time >= midi.GetSongEndMicroseconds())
 	{
@@ -398,17 +409,22 @@ void Metronome::UpdateMeter(Midi &midi)
 		m_pSyncBeatSound->Init(meter_amount, m_mMeterLength, 0);
 	}
 
-	midi.GetRealTimeMeter(meter_amount, meter_unit, midi.GetSongPositionInMicroseconds());
-	m_mMeterLength = 4 * midi.GetSongRunningTempoMicroseconds(midi.GetSongPositionInMicroseconds()) / meter_unit;
-
 	now_time = midi.GetSongPositionInMicroseconds();
-	midi.GetSongBarIDAndMeterID(bar_id, meter_id, now_time);
+	m_cNow.Seek(midi, now_time);
+
+	meter_amount = m_cNow.MeterAmount();
+	meter_unit = m_cNow.MeterUnit();
+	m_mMeterLength = rate.SongToTransport(4 * m_cNow.Tempo() / meter_unit);
+
+	bar_id = m_cNow.BarId();
+	meter_id = m_cNow.MeterId();
 	position = now_time - midi.GetBarForMeterStartMicroseconds(bar_id, meter_id);
 	if (position > 0)
 	{
 		meter_id++;
 		meter_id %= meter_amount;
 	}
+	position = rate.SongToTransport(position);
 
 
 	if (m_pFreeBeatFrames != NULL)
@@ -4,6 +4,7 @@
 #define _METRONOME_H_
 
 #include "Midi.h"
+#include "TimelineCursor.h"
 #include "MidiTypes.h"
 
 enum MetronomeLight
@@ -128,6 +129,10 @@ private:
 	microseconds_t m_mBarLength;
 	microseconds_t m_mDefer;
 
+	// Tempo, meter, bar and beat at the deferred and current positions
+	TimelineCursor m_cDefer;
+	TimelineCursor m_cNow;
+
 	int m_iTimer;
 	int m_iMeterID;
 	bool m_bPlay;
@@ -2,9 +2,19 @@
 #include "MidiEvent.h"
 #include "MidiTrack.h"
 #include "MidiUtil.h"
+#include "MidiMappedFile.h"
+#include "MidiCache.h"
+#include "MidiByteCursor.h"
+#include "MidiBarCursor.h"
 
 #include <fstream>
 #include <map>
+#include <cstring>
+#include <mutex>
+#include <condition_variable>
+#include <new>
+#include <climits>
+#include <functional>
 
 #include <algorithm>
 
@@ -12,27 +22,127 @@ using namespace std;
 
 Midi Midi::ReadFromFile(std::string filename)
 {
-	//fstream file(reinterpret_cast<const wchar_t*>((filename).c_str()), ios::in | ios::binary);
-	fstream file(filename.c_str(), ios::in | ios::binary);
-	if (!file.good()) throw MidiError(MidiError_BadFilename);
+	return ReadFromFile(filename, MidiReadOptions());
+}
 
-	Midi m;
+Midi Midi::ReadFromFile(std::string filename, const MidiReadOptions &options)
+{
+	// Map the whole file read-only and decode the tracks in place.  The
+	// mapping is released when we leave, whether we succeed or throw.
+	MidiMappedFile file(filename);
+
+	return ReadThroughCache(file.Data(), file.Size(), options);
+}
+
+Midi Midi::ReadThroughCache(const unsigned char *data, size_t length, const MidiReadOptions &options)
+{
+	if (options.cache_directory.empty()) return ReadFromMemory(data, length, options);
+
+	const string cache_filename = MidiCache::CacheFilename(options.cache_directory, data, length);
+
+	try
+	{
+		return MidiCache::ReadFromFile(cache_filename);
+	}
+	catch (const MidiError &)
+	{
+		// Missing, stale or damaged.  Parse the song and (re)write it.
+	}
+
+	Midi m = ReadFromMemory(data, length, options);
 
 	try
 	{
-		m = ReadFromStream(file);
+		MidiCache::WriteToFile(m, cache_filename);
 	}
-	catch (const MidiError &e)
+	catch (const MidiError &)
 	{
-		// Close our file resource before handing the error up
-		file.close();
-		throw e;
+		// The next load will just try again
 	}
 
 	return m;
 }
 
+Midi Midi::ReadFromMemory(const unsigned char *data, size_t length)
+{
+	return ReadFromMemory(data, length, MidiReadOptions());
+}
+
+Midi Midi::ReadFromMemory(const unsigned char *data, size_t length, const MidiReadOptions &options)
+{
+	Midi m;
+
+	// Find where every track lives first.  Each one can then be decoded
+	// directly out of the caller's buffer, independently of the others.
+	MidiChunkList chunks;
+	FindTrackChunks(data, length, m.m_time_division, chunks);
+
+	m.ReadTracks(chunks, options.worker_count);
+
+	m.BuildDerivedData(TempoMap::PulsesPerQuarterNoteOf(m.m_time_division));
+
+	return m;
+}
+
+void Midi::FindTrackChunks(const unsigned char *data, size_t length, unsigned short &time_division, MidiChunkList &chunks, size_t max_chunks)
+{
+	const unsigned char *position = data;
+	const unsigned char *end = data + length;
+
+	// "MThd" + 32-bit length + format + track count + time division
+	const static size_t MidiFileHeaderLength = 14;
+
+	// RIFF wrapped MIDI carries a 20-byte preamble before the usual
+	// header: "RIFF", RIFF length, "RMID", "data" and the data size.
+	const static size_t RiffFileHeaderLength = 20;
+
+	if (length >= 4 && memcmp(position, "RIFF", 4) == 0)
+	{
+		if (length < RiffFileHeaderLength) throw MidiError(MidiError_NoHeader);
+		position += RiffFileHeaderLength;
+	}
+
+	if (static_cast<size_t>(end - position) < 4) throw MidiError(MidiError_NoHeader);
+	if (memcmp(position, "MThd", 4) != 0) throw MidiError(MidiError_UnknownHeaderType);
+	if (static_cast<size_t>(end - position) < MidiFileHeaderLength) throw MidiError(MidiError_NoHeader);
+
+	// Chunk Size is always 6 by definition
+	const static unsigned int MidiFileHeaderChunkLength = 6;
+
+	unsigned long header_length = read_big_endian32(position + 4);
+	if (header_length != MidiFileHeaderChunkLength)
+	{
+		throw MidiError(MidiError_BadHeaderSize);
+	}
+
+	unsigned short format = read_big_endian16(position + 8);
+	unsigned short track_count = read_big_endian16(position + 10);
+	time_division = read_big_endian16(position + 12);
+	position += MidiFileHeaderLength;
+
+	// We do not support MIDI 2 at this time (see ReadFromStream)
+	if (format == 2) throw MidiError(MidiError_Type2MidiNotSupported);
+
+	// MIDI 0 has only 1 track by definition
+	if (format == 0 && track_count != 1) throw MidiError(MidiError_BadType0Midi);
+
+	if (!TempoMap::IsValidTimeDivision(time_division)) throw MidiError(MidiError_UnsupportedSmpteRate);
+
+	chunks.clear();
+	for (int i = 0; i < track_count && chunks.size() < max_chunks; ++i)
+	{
+		size_t track_length = MidiTrack::ReadChunkHeader(position, end);
+		chunks.push_back(make_pair(position, track_length));
+		position += track_length;
+	}
+}
+
 Midi Midi::ReadFromStream(istream &stream)
+{
+	return ReadFromStream(stream, MidiReadOptions());
+}
+
+Midi Midi::ReadFromStream(istream &stream, const MidiReadOptions &options)
 {
 	Midi m;
 
@@ -59,13 +169,13 @@ Midi Midi::ReadFromStream(istream &stream)
 		{
 			// We know how to support RIFF files
 			unsigned int throw_away;
-			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned long)); // RIFF length
-			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned long)); // "RMID"
-			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned long)); // "data"
-			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned long)); // data size
+			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // RIFF length
+			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // "RMID"
+			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // "data"
+			stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // data size
 
 			// Call this recursively, without the RIFF header this time
-			return ReadFromStream(stream);
+			return ReadFromStream(stream, options);
 		}
 	}
 
@@ -111,85 +221,409 @@ Midi Midi::ReadFromStream(istream &stream)
 	// - pulses per quarter note (15-bits)
 	// - SMTPE frames per second (7-bits for SMPTE frame count and 8-bits for clock ticks per frame)
 	time_division = swap16(time_division);
-	bool in_smpte = ((time_division & 0x8000) != 0);
-
-	if (in_smpte)
+	if (!TempoMap::IsValidTimeDivision(time_division))
 	{
-		throw MidiError(MidiError_SMTPETimingNotImplemented);
+		throw MidiError(MidiError_UnsupportedSmpteRate);
 	}
 	m.m_time_division = time_division;
 
-	// We ignore the possibility of SMPTE timing, so we can
-	// use the time division value directly as PPQN.
-	unsigned short pulses_per_quarter_note = time_division;
+	// SMPTE timing is turned into an equivalent PPQN at a fixed tempo
+	// (see TempoMap), so everything past here only deals in PPQN.
+	unsigned short pulses_per_quarter_note = TempoMap::PulsesPerQuarterNoteOf(time_division);
 
-	// Read in our tracks
+	// Read in our tracks.  The stream has to be walked in order, but
+	// once each chunk is in hand they can be decoded side by side.
+	vector<vector<unsigned char> > bodies(track_count);
+	MidiChunkList chunks;
 	for (int i = 0; i < track_count; ++i)
 	{
-		m.m_tracks.push_back(MidiTrack::ReadFromStream(stream));
+		MidiTrack::ReadChunkFromStream(stream, bodies[i]);
+		chunks.push_back(make_pair(bodies[i].empty() ? NULL : &bodies[i][0], bodies[i].size()));
 	}
 
+	m.ReadTracks(chunks, options.worker_count);
 
-	m.TranslatePrivateInfo();
+	m.BuildDerivedData(pulses_per_quarter_note);
 
-	m.BuildMeterTrack();
-	m.BuildTempoTrack();
+	return m;
+}
 
-	m.BuildBarTimeList(pulses_per_quarter_note);
+void Midi::ReadTracks(const MidiChunkList &chunks, unsigned int worker_count)
+{
+	// Each job fills its own slot, so the final order is always the
+	// chunk order no matter which worker finishes first.
+	MidiTrackList tracks(chunks.size(), MidiTrack::CreateBlankTrack());
 
-	m.TranslateRealTimeMeter(m.m_init_meter_amount, m.m_init_meter_unit);
+	run_parallel(chunks.size(), worker_count, [&](size_t i)
+	{
+		tracks[i] = MidiTrack::ReadFromMemory(chunks[i].first, chunks[i].second, i);
+	});
 
-	// Tell our tracks their IDs
-	for (int i = 0; i < track_count; ++i)
+	m_tracks.swap(tracks);
+}
+
+void Midi::BuildDerivedData(unsigned short pulses_per_quarter_note)
+{
+	TranslatePrivateInfo();
+
+	BuildMeterTrack();
+	BuildTempoTrack();
+
+	m_tempo_map = TempoMap(m_tracks.back(), m_time_division);
+
+	BuildBarTimeList(pulses_per_quarter_note, FindLastNoteOffPulse());
+
+	TranslateRealTimeMeter(m_init_meter_amount, m_init_meter_unit);
+
+	unsigned long first_note_pulse = FindFirstNoteOnPulse();
+
+	// of events into microseconds.
+	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i)
 	{
-		m.m_tracks[i].SetTrackId(i);
-		m.m_tracks[i].SetTrackName(m.GetTrackName(m.m_tracks[i].Events()));
+		BuildEventUsecs(*i, 0, pulses_per_quarter_note);
 	}
 
-	unsigned long first_note_pulse = m.FindFirstNoteOnPulse();
+	size_t note_count = 0;
+	for (MidiTrackList::const_iterator i = m_tracks.begin(); i != m_tracks.end(); ++i) note_count += i->SortedNotes().size();
 
-	// of events into microseconds.
-	for (MidiTrackList::iterator i = m.m_tracks.begin(); i != m.m_tracks.end(); ++i)
+	// Translate each track's list of notes and list
+	vector<TranslatedNote> notes;
+	notes.reserve(note_count);
+	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i)
+	{
+		i->Reset();
+
+		TranslateNotes(i->SortedNotes(), i->GetTrackName(), pulses_per_quarter_note, notes);
+		//TranslateNotes(i->SortedNotes(), i->GetTrackName(), pulses_per_quarter_note, first_note_pulse, notes);
+	}
+
+	SetNotes(notes);
+
+	m_initialized = true;
+
+	// Just grab the end of the last note to find out how long the song is
+	m_microsecond_base_song_length = m_note_table.Empty() ? 0 : m_note_table.Ends().back();
+
+	BuildSongBounds(pulses_per_quarter_note, first_note_pulse);
+}
+
+void Midi::BuildSongBounds(unsigned short pulses_per_quarter_note, unsigned long first_note_pulses)
+{
+	// Eat everything up until *just* before the first note event
+	m_microsecond_dead_start_air = GetEventPulseInMicroseconds(first_note_pulses, pulses_per_quarter_note) - 1;
+
+	m_reserved_bars = GetSongReservedBarCount(first_note_pulses);
+
+	m_microsecond_song_start = m_bar_usecs[m_reserved_bars];
+	m_microsecond_song_end = m_bar_usecs[GetSongBarCount()];
+
+	m_microsecond_init_running_tempo = GetSongRunningTempoMicroseconds();
+
+	m_init_ticks = GetSongTicks(m_microsecond_init_running_tempo);
+}
+
+void Midi::BuildEventUsecs(MidiTrack &track, size_t first_event, unsigned short pulses_per_quarter_note) const
+{
+	const MidiEventPulsesList &pulses = track.EventPulses();
+	MidiEventMicrosecondList &usecs = track.EventUsecs();
+
+	usecs.resize(pulses.size());
+	if (first_event >= pulses.size()) return;
+
+	if (m_tracks.size() == 0)
+	{
+		fill(usecs.begin() + first_event, usecs.end(), 0);
+		return;
+	}
+
+	// One merge of this track's (sorted) pulses against the tempo changes
+	const size_t count = pulses.size() - first_event;
+	if (pulses_per_quarter_note == m_tempo_map.PulsesPerQuarterNote())
+	{
+		m_tempo_map.PulsesToMicroseconds(&pulses[first_event], count, &usecs[first_event]);
+	}
+	else
+	{
+		TempoMap(m_tracks.back(), pulses_per_quarter_note).PulsesToMicroseconds(&pulses[first_event], count, &usecs[first_event]);
+	}
+}
+
+// What one quick pass over the track chunks tells us (see ScanTimeline)
+struct MidiTimelineScan
+{
+	MidiTimelineScan() : first_note_pulses(0), last_note_pulses(0) { }
+
+	// First track-name event of each chunk
+	std::vector<std::string> track_names;
+
+	// Text events from the first track (where PrivateData lives)
+	MidiEventList private_events;
+
+	// Same values FindFirstNoteOnPulse/FindLastNoteOffPulse give once
+	// the whole file is loaded
+	unsigned long first_note_pulses;
+	unsigned long last_note_pulses;
+};
+
+void Midi::ScanTimeline(const MidiChunkList &chunks, MidiTimelineScan &scan)
+{
+	std::map<unsigned long, MidiEvent> meter_events;
+	std::map<unsigned long, MidiEvent> tempo_events;
+
+	unsigned long latest_pulses = 0;
+	unsigned long first_note_pulses = ULONG_MAX;
+
+	scan.track_names.assign(chunks.size(), std::string());
+	scan.private_events.clear();
+
+	for (size_t t = 0; t < chunks.size(); ++t)
 	{
-		MidiEventMicrosecondList event_usecs;
+		MidiByteCursor cursor(chunks[t].first, chunks[t].second);
 
-		for (MidiEventPulsesList::const_iterator j = i->EventPulses().begin(); j != i->EventPulses().end(); ++j)
+		bool named = false;
+		bool found_note_on = false;
+		unsigned char last_status = 0;
+		unsigned long pulses = 0;
+		while (!cursor.AtEnd())
 		{
-			event_usecs.push_back(m.GetEventPulseInMicroseconds(*j, pulses_per_quarter_note));
+			MidiEvent ev = MidiEvent::ReadFromCursor(cursor, last_status);
+			last_status = ev.StatusCode();
+			pulses += ev.GetDeltaPulses();
+
+			switch (ev.Type())
+			{
+			case MidiEventType_NoteOn:
+				if (!found_note_on && pulses < first_note_pulses) first_note_pulses = pulses;
+				found_note_on = true;
+
+				if (ev.NoteVelocity() == 0 && pulses > scan.last_note_pulses) scan.last_note_pulses = pulses;
+				break;
+
+			case MidiEventType_NoteOff:
+				if (pulses > scan.last_note_pulses) scan.last_note_pulses = pulses;
+				break;
+
+			case MidiEventType_Meta:
+				if (ev.MetaType() == MidiMetaEvent_TimeSignature) meter_events[pulses] = ev;
+				if (ev.MetaType() == MidiMetaEvent_TempoChange) tempo_events[pulses] = ev;
+
+				if (ev.MetaType() == MidiMetaEvent_TrackName && !named)
+				{
+					scan.track_names[t] = ev.Text();
+					named = true;
+				}
+
+				if (t == 0 && ev.MetaType() == MidiMetaEvent_Text) scan.private_events.push_back(ev);
+				break;
+
+			default:
+				break;
+			}
 		}
 
-		i->SetEventUsecs(event_usecs);
+		if (pulses > latest_pulses) latest_pulses = pulses;
 	}
 
-	// Translate each track's list of notes and list
-	for (MidiTrackList::iterator i = m.m_tracks.begin(); i != m.m_tracks.end(); ++i)
+	// FindFirstNoteOnPulse starts from the latest event in the song
+	scan.first_note_pulses = (first_note_pulses < latest_pulses) ? first_note_pulses : latest_pulses;
+
+	m_tracks.assign(chunks.size(), MidiTrack::CreateBlankTrack());
+	AppendTrackFromEvents(meter_events);
+	AppendTrackFromEvents(tempo_events);
+
+	m_tempo_map = TempoMap(m_tracks.back(), m_time_division);
+}
+
+void Midi::LoadTimeline(const MidiChunkList &chunks, MidiTimelineScan &scan)
+{
+	const unsigned short pulses_per_quarter_note = TempoMap::PulsesPerQuarterNoteOf(m_time_division);
+
+	ScanTimeline(chunks, scan);
+
+	TranslatePrivateInfo(scan.private_events);
+
+	BuildBarTimeList(pulses_per_quarter_note, scan.last_note_pulses);
+
+	TranslateRealTimeMeter(m_init_meter_amount, m_init_meter_unit);
+
+	// The meter and tempo tracks are complete already, everything else
+	// is still empty.  DecodeUntil gives the notes their track id.
+	for (size_t i = 0; i < m_tracks.size(); ++i)
 	{
-		i->Reset();
+		if (i < chunks.size()) m_tracks[i].SetTrackName(scan.track_names[i]);
 
-		m.TranslateNotes(i->Notes(), pulses_per_quarter_note);
-		//m.TranslateNotes(i->Notes(), pulses_per_quarter_note, first_note_pulse);
+		BuildEventUsecs(m_tracks[i], 0, pulses_per_quarter_note);
+		m_tracks[i].Reset();
 	}
 
-	m.m_initialized = true;
+	m_initialized = true;
 
-	// Just grab the end of the last note to find out how long the song is
-	m.m_microsecond_base_song_length = m.m_translated_notes.empty() ? 0 : m.m_translated_notes.rbegin()->end;
+	// Good enough until the notes are in (see FinishProgressiveLoad)
+	m_microsecond_base_song_length = GetEventPulseInMicroseconds(scan.last_note_pulses, pulses_per_quarter_note);
 
-	// Eat everything up until *just* before the first note event
-	m.m_microsecond_dead_start_air = m.GetEventPulseInMicroseconds(m.FindFirstNoteOnPulse(), pulses_per_quarter_note) - 1;
+	BuildSongBounds(pulses_per_quarter_note, scan.first_note_pulses);
+}
 
-	m.m_reserved_bars = m.GetSongReservedBarCount(first_note_pulse);
+Midi Midi::BeginProgressiveLoad(std::string filename)
+{
+	Midi m;
+
+	shared_ptr<MidiMappedFile> file(new MidiMappedFile(filename));
+
+	MidiChunkList chunks;
+	FindTrackChunks(file->Data(), file->Size(), m.m_time_division, chunks);
 
-	m.m_microsecond_song_start = m.m_bar_usecs[m.m_reserved_bars];
-	m.m_microsecond_song_end = m.m_bar_usecs[m.GetSongBarCount()];
+	MidiTimelineScan scan;
+	m.LoadTimeline(chunks, scan);
 
-	m.m_microsecond_init_running_tempo = m.GetSongRunningTempoMicroseconds();
+	m.m_progressive.file = file;
+	m.m_progressive.pulses_per_quarter_note = TempoMap::PulsesPerQuarterNoteOf(m.m_time_division);
+	for (size_t i = 0; i < chunks.size(); ++i)
+	{
+		m.m_progressive.tracks.push_back(MidiTrackDecodeState(chunks[i].first, chunks[i].second));
+	}
 
-	m.m_init_ticks = m.GetSongTicks(m.m_microsecond_init_running_tempo);
+	// Have the first bar ready to go
+	m.ContinueProgressiveLoad(0);
 
 	return m;
 }
 
+bool Midi::ContinueProgressiveLoad(microseconds_t until)
+{
+	if (IsFullyLoaded()) return true;
+
+	// Always finish a whole bar past 'until' so playback doesn't catch
+	// up with the decoder in the middle of one.  Past the last bar we
+	// just decode everything that's left.
+	unsigned long until_pulses = ULONG_MAX;
+
+	MidiEventMicrosecondList::const_iterator bar = upper_bound(m_bar_usecs.begin(), m_bar_usecs.end(), until);
+	if (bar != m_bar_usecs.end())
+	{
+		until_pulses = m_bar_pulses[bar - m_bar_usecs.begin()];
+	}
+
+	if (until_pulses <= m_progressive.loaded_pulses) return false;
+
+	const unsigned short pulses_per_quarter_note = m_progressive.pulses_per_quarter_note;
+
+	NoteList new_notes;
+	vector<TranslatedNote> notes;
+	bool finished = true;
+	for (size_t i = 0; i < m_progressive.tracks.size(); ++i)
+	{
+		MidiTrack &track = m_tracks[i];
+		const size_t first_new_event = track.Events().size();
+
+		new_notes.clear();
+		track.DecodeUntil(m_progressive.tracks[i], until_pulses, i, new_notes);
+		BuildEventUsecs(track, first_new_event, pulses_per_quarter_note);
+
+		TranslateNotes(new_notes, track.GetTrackName(), pulses_per_quarter_note, notes);
+
+		finished = finished && m_progressive.tracks[i].finished;
+	}
+
+	// They go in the table (and Notes()) in one go
+	AddNotes(notes);
+
+	m_progressive.loaded_pulses = until_pulses;
+
+	if (finished) FinishProgressiveLoad();
+
+	return finished;
+}
+
+void Midi::FinishProgressiveLoad()
+{
+	for (size_t i = 0; i < m_progressive.tracks.size(); ++i)
+	{
+		m_tracks[i].FinishDecoding();
+	}
+
+	// Just grab the end of the last note to find out how long the song is
+	if (!m_note_table.Empty()) m_microsecond_base_song_length = m_note_table.Ends().back();
+
+	// Lets go of the mapped file
+	m_progressive = MidiProgressiveState();
+}
+
+MidiLoadResultList Midi::ReadManyFromFiles(const vector<string> &filenames, const MidiBatchOptions &options)
+{
+	// A decoded song takes up a good deal more room than the file it
+	// came from (every 3-byte event becomes a MidiEvent, notes get
+	// paired and translated...).  This is a rough, deliberately generous
+	// multiplier used to estimate what a load in flight will need.
+	const static size_t LoadMemoryPerFileByte = 32;
+
+	MidiLoadResult empty = { string(), false, MidiError_LoadFailed, Midi() };
+	MidiLoadResultList results(filenames.size(), empty);
+
+	mutex budget_lock;
+	condition_variable budget_freed;
+	size_t budget_used = 0;
+	size_t loads_in_flight = 0;
+
+	run_parallel(filenames.size(), options.worker_count, [&](size_t i)
+	{
+		MidiLoadResult &result = results[i];
+		result.filename = filenames[i];
+
+		size_t estimate = 0;
+		bool reserved = false;
+
+		try
+		{
+			MidiMappedFile file(filenames[i]);
+			estimate = file.Size() * LoadMemoryPerFileByte;
+
+			if (options.memory_limit > 0)
+			{
+				unique_lock<mutex> lock(budget_lock);
+				while (loads_in_flight > 0 && budget_used + estimate > options.memory_limit)
+				{
+					budget_freed.wait(lock);
+				}
+
+				budget_used += estimate;
+				++loads_in_flight;
+				reserved = true;
+			}
+
+			result.midi = ReadThroughCache(file.Data(), file.Size(), options.read_options);
+			result.success = true;
+		}
+		catch (const MidiError &e)
+		{
+			result.error = e.m_error;
+		}
+		catch (const bad_alloc &)
+		{
+			result.error = MidiError_OutOfMemory;
+		}
+		catch (const exception &)
+		{
+			result.error = MidiError_LoadFailed;
+		}
+		catch (...)
+		{
+			// Whatever it was, it only fails this one file
+			result.error = MidiError_LoadFailed;
+		}
+
+		if (reserved)
+		{
+			lock_guard<mutex> lock(budget_lock);
+			budget_used -= estimate;
+			--loads_in_flight;
+			budget_freed.notify_all();
+		}
+	});
+
+	return results;
+}
+
 Midi Midi::LinkMidi(vector<std::string> files)
 {
 	Midi m;
@@ -226,29 +660,10 @@ Midi Midi::LinkMidi(vector<std::string> files)
 			m.m_bar_usecs.push_back(usecsEnd + us);
 		}
 
-		microseconds_t meterStart = m.m_meter_start_usecs.back().back().second;
-		for (auto ms : lm.m_meter_start_usecs)
-		{
-			MeterMicrosecondList newMeterStart;
-			for (auto mn : ms)
-			{
-				mn.second += meterStart;
-				newMeterStart.push_back(mn);
-			}
-			m.m_meter_start_usecs.push_back(newMeterStart);
-		}
-
-		microseconds_t meterEnd = m.m_meter_end_usecs.back().back().second;
-		for (auto me : lm.m_meter_end_usecs)
-		{
-			MeterMicrosecondList newMeterEnd;
-			for (auto mn : me)
-			{
-				mn.second += meterEnd;
-				newMeterEnd.push_back(mn);
-			}
-			m.m_meter_end_usecs.push_back(newMeterEnd);
-		}
+		const MidiBeatGrid &grid = m.m_beat_grid;
+		const size_t last_bar = grid.BarCount() - 1;
+		const MidiBeat &last_beat = grid.BarBeats(last_bar)[grid.BeatCount(last_bar) - 1];
+		m.m_beat_grid.Append(lm.m_beat_grid, last_beat.start, last_beat.end);
 	}
 
 	list_m.clear();
@@ -280,118 +695,86 @@ bool Midi::LinkMidiTrack(std::string track_name, MidiTrack &track)
 	return t->LinkMidiTrack(track, deltaPulses, this->m_bar_pulses.back(), this->m_bar_usecs.back());
 }
 
-Midi Midi::ReadPrivateInfoFromFile(std::string filename)
+// Walks a track chunk until 'found' returns true for one of its meta
+// events of the given type.  Nothing past that event is decoded.
+static void find_meta_event(const pair<const unsigned char*, size_t> &chunk, MidiMetaEventType meta_type, const function<bool(const MidiEvent&)> &found)
 {
-	fstream file(filename.c_str(), ios::in | ios::binary);
-	if (!file.good()) throw MidiError(MidiError_BadFilename);
-
-	Midi m;
+	MidiByteCursor cursor(chunk.first, chunk.second);
 
-	try
+	unsigned char last_status = 0;
+	while (!cursor.AtEnd())
 	{
-		istream &stream = file;
+		MidiEvent ev = MidiEvent::ReadFromCursor(cursor, last_status);
+		last_status = ev.StatusCode();
 
-		const static string MidiFileHeader = "MThd";
-		const static string RiffFileHeader = "RIFF";
+		if (ev.Type() == MidiEventType_Meta && ev.MetaType() == meta_type && found(ev)) return;
+	}
+}
 
-		// I could use (MidiFileHeader.length() + 1), but then this has to be
-		// dynamically allocated.  More hassle than it's worth.  MIDI is well
-		// defined and will always have a 4-byte header.  We use 5 so we get
-		// free null termination.
-		char           header_id[5] = { 0, 0, 0, 0, 0 };
-		unsigned int   header_length;
-		unsigned short format;
-		unsigned short track_count;
-		unsigned short time_division;
+MidiSummary Midi::ReadSummaryFromFile(std::string filename, unsigned int fields)
+{
+	MidiMappedFile file(filename);
+	return ReadSummaryFromMemory(file.Data(), file.Size(), fields);
+}
 
-		stream.read(header_id, static_cast<streamsize>(MidiFileHeader.length()));
-		string header(header_id);
-		if (header != MidiFileHeader)
-		{
-			if (header != RiffFileHeader) throw MidiError(MidiError_UnknownHeaderType);
-			else
-			{
-				// We know how to support RIFF files
-				unsigned int throw_away;
-				stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // RIFF length
-				stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // "RMID"
-				stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // "data"
-				stream.read(reinterpret_cast<char*>(&throw_away), sizeof(unsigned int)); // data size
-
-																						  // Call this recursively, without the RIFF header this time
-				return ReadFromStream(stream);
-			}
-		}
+MidiSummary Midi::ReadSummaryFromMemory(const unsigned char *data, size_t length, unsigned int fields)
+{
+	MidiSummary summary;
 
-		stream.read(reinterpret_cast<char*>(&header_length), sizeof(unsigned int));
-		stream.read(reinterpret_cast<char*>(&format), sizeof(unsigned short));
-		stream.read(reinterpret_cast<char*>(&track_count), sizeof(unsigned short));
-		stream.read(reinterpret_cast<char*>(&time_division), sizeof(unsigned short));
+	// PrivateData only ever lives in the first track
+	const size_t max_chunks = (fields & ~MidiSummary_PrivateInfo) ? static_cast<size_t>(-1) : 1;
 
-		if (stream.fail()) throw MidiError(MidiError_NoHeader);
+	unsigned short time_division;
+	MidiChunkList chunks;
+	FindTrackChunks(data, length, time_division, chunks, max_chunks);
 
-		// Chunk Size is always 6 by definition
-		const static unsigned int MidiFileHeaderChunkLength = 6;
+	summary.pulses_per_quarter_note = TempoMap::PulsesPerQuarterNoteOf(time_division);
 
-		header_length = swap32(header_length);
-		if (header_length != MidiFileHeaderChunkLength)
-		{
-			throw MidiError(MidiError_BadHeaderSize);
-		}
+	if (fields & MidiSummary_Timing)
+	{
+		// Timing needs the meter and tempo maps and the last note from
+		// every track.  That walk turns up everything else as well.
+		Midi m;
+		m.m_time_division = time_division;
 
-		const static int MidiFormat0 = 0;
-		const static int MidiFormat1 = 1;
-		const static int MidiFormat2 = 2;
+		MidiTimelineScan scan;
+		m.LoadTimeline(chunks, scan);
 
-		format = swap16(format);
-		if (format == MidiFormat2)
-		{
-			// MIDI 0: All information in 1 track
-			// MIDI 1: Multiple tracks intended to be played simultaneously
-			// MIDI 2: Multiple tracks intended to be played separately
-			//
-			// We do not support MIDI 2 at this time
-			throw MidiError(MidiError_Type2MidiNotSupported);
-		}
+		summary.private_info = m.m_private_info;
+		summary.track_names = scan.track_names;
+		summary.bar_count = m.GetSongBarCount();
+		summary.song_length = m.GetSongLengthInMicroseconds();
 
-		track_count = swap16(track_count);
-		if (format == 0 && track_count != 1)
-		{
-			// MIDI 0 has only 1 track by definition
-			throw MidiError(MidiError_BadType0Midi);
-		}
+		return summary;
+	}
 
-		// Time division can be encoded two ways based on a bit-flag:
-		// - pulses per quarter note (15-bits)
-		// - SMTPE frames per second (7-bits for SMPTE frame count and 8-bits for clock ticks per frame)
-		time_division = swap16(time_division);
-		bool in_smpte = ((time_division & 0x8000) != 0);
+	if ((fields & MidiSummary_PrivateInfo) && !chunks.empty())
+	{
+		PrivateData &info = summary.private_info;
+		find_meta_event(chunks.front(), MidiMetaEvent_Text, [&info](const MidiEvent &ev) { return ParsePrivateInfo(ev, info); });
+	}
 
-		if (in_smpte)
+	if (fields & MidiSummary_TrackNames)
+	{
+		summary.track_names.assign(chunks.size(), string());
+		for (size_t i = 0; i < chunks.size(); ++i)
 		{
-			throw MidiError(MidiError_SMTPETimingNotImplemented);
+			string &name = summary.track_names[i];
+			find_meta_event(chunks[i], MidiMetaEvent_TrackName, [&name](const MidiEvent &ev) { name = ev.Text(); return true; });
 		}
+	}
 
-		// We ignore the possibility of SMPTE timing, so we can
-		// use the time division value directly as PPQN.
-		unsigned short pulses_per_quarter_note = time_division;
-
-		// Read in our tracks
-		m.m_tracks.push_back(MidiTrack::ReadFromStream(stream));
+	return summary;
+}
 
-		m.TranslatePrivateInfo();
-	}
-	catch (const MidiError &e)
-	{
-		// Close our file resource before handing the error up
-		file.close();
-		throw e;
-	}
+Midi Midi::ReadPrivateInfoFromFile(std::string filename)
+{
+	Midi m;
+	m.m_private_info = ReadSummaryFromFile(filename, MidiSummary_PrivateInfo).private_info;
 
 	return m;
 }
 
-
 void Midi::BuildMeterTrack()
 {
 	std::map<unsigned long, MidiEvent> meter_events;
@@ -431,23 +814,7 @@ void Midi::BuildMeterTrack()
 		}
 	}
 
-	m_tracks.push_back(MidiTrack::CreateBlankTrack());
-
-	MidiEventList &tempo_track_events = m_tracks[m_tracks.size() - 1].Events();
-	MidiEventPulsesList &tempo_track_event_pulses = m_tracks[m_tracks.size() - 1].EventPulses();
-
-	unsigned long previous_absolute_pulses = 0;
-	for (std::map<unsigned long, MidiEvent>::const_iterator i = meter_events.begin(); i != meter_events.end(); ++i)
-	{
-		unsigned long absolute_pulses = i->first;
-		MidiEvent ev = i->second;
-
-		ev.SetDeltaPulses(absolute_pulses - previous_absolute_pulses);
-		previous_absolute_pulses = absolute_pulses;
-
-		tempo_track_event_pulses.push_back(absolute_pulses);
-		tempo_track_events.push_back(ev);
-	}
+	AppendTrackFromEvents(meter_events);
 
 	return;
 }
@@ -518,14 +885,19 @@ void Midi::BuildTempoTrack()
 	}
 
 	// Create a new track (always the last track in the track list)
+	AppendTrackFromEvents(tempo_events);
+}
+
+void Midi::AppendTrackFromEvents(const std::map<unsigned long, MidiEvent> &events)
+{
 	m_tracks.push_back(MidiTrack::CreateBlankTrack());
 
-	MidiEventList &tempo_track_events = m_tracks[m_tracks.size() - 1].Events();
-	MidiEventPulsesList &tempo_track_event_pulses = m_tracks[m_tracks.size() - 1].EventPulses();
+	MidiEventList &track_events = m_tracks[m_tracks.size() - 1].Events();
+	MidiEventPulsesList &track_event_pulses = m_tracks[m_tracks.size() - 1].EventPulses();
 
-	// Copy over all our tempo events
+	// Copy over all the events
 	unsigned long previous_absolute_pulses = 0;
-	for (std::map<unsigned long, MidiEvent>::const_iterator i = tempo_events.begin(); i != tempo_events.end(); ++i)
+	for (std::map<unsigned long, MidiEvent>::const_iterator i = events.begin(); i != events.end(); ++i)
 	{
 		unsigned long absolute_pulses = i->first;
 		MidiEvent ev = i->second;
@@ -535,17 +907,21 @@ void Midi::BuildTempoTrack()
 		previous_absolute_pulses = absolute_pulses;
 
 		// Add them to the track
-		tempo_track_event_pulses.push_back(absolute_pulses);
-		tempo_track_events.push_back(ev);
+		track_event_pulses.push_back(absolute_pulses);
+		track_events.push_back(ev);
 	}
+
+	// They still carry the names of the tracks they came from
+	m_tracks.back().SetTrackName(GetTrackName(track_events));
 }
 
-MidiEventMicrosecondList Midi::GetBarUsecs(){
+const MidiEventMicrosecondList &Midi::GetBarUsecs() const
+{
 
 	return m_bar_usecs;
 }
 
-void Midi::BuildBarTimeList(unsigned short pulses_per_quarter_note)
+void Midi::BuildBarTimeList(unsigned short pulses_per_quarter_note, unsigned long last_note_pulses)
 {
 	if (m_tracks.size() <= 2)
 	{
@@ -554,199 +930,577 @@ void Midi::BuildBarTimeList(unsigned short pulses_per_quarter_note)
 
 	const MidiTrack &meterTrack = m_tracks[m_tracks.size() - 2];
 
-	if (meterTrack.Events().size() <= 0)
+	if (meterTrack.Events().size() <= 0)
+	{
+		return;
+	}
+
+	int meter_amount;
+	int meter_unit;
+	int bar_num = 0;
+
+	unsigned long pulses_bar;
+	unsigned long ev_pulses;
+	unsigned long bar_pulses = 0;
+
+	for (size_t i = 0; i < meterTrack.Events().size(); ++i)
+	{
+
+		size_t last_i = i + 1;
+		if (last_i < meterTrack.Events().size())
+		{
+			if (meterTrack.Events()[i].BeatMember() == meterTrack.Events()[last_i].BeatMember()
+				&& meterTrack.Events()[i].BeatDenominator() == meterTrack.Events()[last_i].BeatDenominator())
+			{
+				continue;
+			}
+		}
+
+		meter_amount = meterTrack.Events()[i].BeatMember();
+		meter_unit = meterTrack.Events()[i].BeatDenominator();
+
+		pulses_bar = 4 * pulses_per_quarter_note * meter_amount / meter_unit;
+
+		bar_pulses = (bar_num == 0) ? 0 : bar_pulses;// (bar_pulses + pulses_bar);
+		if (last_i >= meterTrack.Events().size())
+		{
+			break;
+		}
+		ev_pulses = meterTrack.EventPulses()[last_i];
+
+		while (bar_pulses < ev_pulses)
+		{
+			m_beat_grid.AddBar();
+			for (int j = 0; j < meter_amount; ++j)
+			{
+				unsigned long meter_start_pulses = 4 * pulses_per_quarter_note * j / meter_unit;
+				unsigned long meter_end_pulses = 4 * pulses_per_quarter_note * (j+1) / meter_unit;
+				m_beat_grid.AddBeat(GetEventPulseInMicroseconds(bar_pulses + meter_start_pulses, pulses_per_quarter_note),
+					GetEventPulseInMicroseconds(bar_pulses + meter_end_pulses, pulses_per_quarter_note));
+			}
+
+			++bar_num;
+			m_bar_pulses.push_back(bar_pulses);
+			m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
+			bar_pulses = (bar_num == 0) ? 0 : (bar_pulses + pulses_bar);
+		}
+	}
+
+	ev_pulses = last_note_pulses;
+	while (bar_pulses <= ev_pulses)
+	{
+		m_beat_grid.AddBar();
+		for (int j = 0; j < meter_amount; ++j)
+		{
+			unsigned long meter_start_pulses = 4 * pulses_per_quarter_note * j / meter_unit;
+			unsigned long meter_end_pulses = 4 * pulses_per_quarter_note * (j + 1) / meter_unit;
+			m_beat_grid.AddBeat(GetEventPulseInMicroseconds(bar_pulses + meter_start_pulses, pulses_per_quarter_note),
+				GetEventPulseInMicroseconds(bar_pulses + meter_end_pulses, pulses_per_quarter_note));
+		}
+
+		++bar_num;
+		m_bar_pulses.push_back(bar_pulses);
+		m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
+		bar_pulses = (bar_num == 0) ? 0 : (bar_pulses + pulses_bar);
+	}
+
+	if (ev_pulses == m_bar_pulses.back())
+	{
+		return;
+	}
+
+	m_bar_pulses.push_back(bar_pulses);
+	m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
+
+	return;
+}
+
+const MidiTrack Midi::FindTrack(std::string track_name)
+{
+	MidiTrackList::iterator t = m_tracks.begin();
+
+	while (t != m_tracks.end())
+	{
+		if (track_name == GetTrackName(t->Events()))
+		{
+			break;
+		}
+
+		++t;
+	}
+
+	return *t;
+}
+
+TranslatedNoteSet Midi::FindNotes(std::string track_name)
+{
+	const MidiNoteView view = FindNoteView(track_name);
+
+	// The view is in set order, so each one goes on the end
+	TranslatedNoteSet notes;
+	for (size_t i = 0; i < view.Size(); ++i) notes.insert(notes.end(), view.Note(i));
+
+	return notes;
+}
+
+int Midi::GetSongReservedBarCount(unsigned long first_note_pulses) const
+{
+	int bar_sum = -1;
+	for (MidiEventPulsesList::const_iterator i = m_bar_pulses.begin(); i != m_bar_pulses.end(); ++i)
+	{
+		if ((*i) > first_note_pulses)
+		{
+			break;
+		}
+
+		++bar_sum;
+	}
+
+	return bar_sum;
+}
+
+void Midi::TranslateNotes(const NoteList &notes, const string &track_name, unsigned short pulses_per_quarter_note,
+	vector<TranslatedNote> &translated)
+{
+	// Notes come in start order, so these mostly just step along
+	MidiBarCursor bars;
+	size_t tempo_hint = 0;
+
+	for (NoteList::const_iterator i = notes.begin(); i != notes.end(); ++i)
+	{
+		TranslatedNote trans;
+
+		trans.note_id = i->note_id;
+		trans.track_id = i->track_id;
+		trans.channel = i->channel;
+		trans.velocity = i->velocity;
+		trans.start = GetEventPulseInMicroseconds(i->start, pulses_per_quarter_note);
+		trans.end = GetEventPulseInMicroseconds(i->end, pulses_per_quarter_note);
+		trans.time_unit = m_tempo_map.TempoAtMicroseconds(trans.start, tempo_hint);
+		trans.bar_id = bars.FindBar(*this, trans.start);
+		trans.track_name = track_name;
+		trans.state = UserPlayable;
+
+		translated.push_back(trans);
+	}
+}
+
+void Midi::TranslateNotes(const NoteList &notes, const string &track_name, unsigned short pulses_per_quarter_note,
+	unsigned long first_note_pulses, vector<TranslatedNote> &translated)
+{
+	MidiBarCursor bars;
+	size_t tempo_hint = 0;
+
+	int uiMember;
+	int uiDenominator;
+
+	unsigned long pulses_bar;
+
+	for (NoteList::const_iterator i = notes.begin(); i != notes.end(); ++i)
+	{
+		TranslateRealTimeMeter(uiMember, uiDenominator, i->start);
+		pulses_bar = 4 * pulses_per_quarter_note * uiMember / uiDenominator;
+
+		TranslatedNote trans;
+
+		trans.note_id = i->note_id;
+		trans.track_id = i->track_id;
+		trans.channel = i->channel;
+		trans.velocity = i->velocity;
+		trans.start = GetEventPulseInMicroseconds(i->start, pulses_per_quarter_note);
+		trans.end = GetEventPulseInMicroseconds(i->end, pulses_per_quarter_note);
+		trans.time_unit = m_tempo_map.TempoAtMicroseconds(trans.start, tempo_hint);
+		trans.bar_id = bars.FindBar(*this, trans.start);
+		trans.track_name = track_name;
+		trans.state = UserPlayable;
+
+		translated.push_back(trans);
+
+		// --------------------------------------------------------------------------------------------------------------
+	}
+}
+
+
+// 'note' with the times a tempo edit gave its row
+static TranslatedNote retimed_note(const TranslatedNote &note, const MidiNoteRetime &retime)
+{
+	TranslatedNote trans = note;
+	trans.start = retime.start;
+	trans.end = retime.end;
+	trans.time_unit = retime.time_unit;
+	trans.bar_id = retime.bar_id;
+
+	return trans;
+}
+
+// 'note' moved by 'delta', past the tempo changes an edit left alone
+static TranslatedNote shifted_note(const TranslatedNote &note, microseconds_t delta)
+{
+	TranslatedNote trans = note;
+	trans.start += delta;
+	trans.end += delta;
+
+	return trans;
+}
+
+void Midi::SetTempoChange(unsigned long pulses, microseconds_t us_per_quarter_note)
+{
+	// Has to fit the three bytes a tempo event has in a file
+	if (us_per_quarter_note <= 0 || us_per_quarter_note > 0xFFFFFF) throw MidiError(MidiError_BadTempo);
+
+	if (m_tracks.empty()) return;
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(LLONG_MAX);
+
+	MidiTrack &tempo_track = m_tracks.back();
+	MidiEventList &events = tempo_track.Events();
+	MidiEventPulsesList &event_pulses = tempo_track.EventPulses();
+	MidiEventMicrosecondList &event_usecs = tempo_track.EventUsecs();
+
+	const size_t i = lower_bound(event_pulses.begin(), event_pulses.end(), pulses) - event_pulses.begin();
+
+	MidiEvent ev = MidiEvent::TempoChange(static_cast<unsigned long>(us_per_quarter_note));
+	if (i < events.size() && event_pulses[i] == pulses)
+	{
+		if (events[i].GetTempoInUsPerQn() == static_cast<unsigned long>(us_per_quarter_note)) return;
+
+		ev.SetDeltaPulses(events[i].GetDeltaPulses());
+		events[i] = ev;
+	}
+	else
+	{
+		ev.SetDeltaPulses(pulses - (i == 0 ? 0 : event_pulses[i - 1]));
+		if (i < events.size()) events[i].SetDeltaPulses(event_pulses[i] - pulses);
+
+		// Nothing up to and including 'pulses' moves, this event included
+		events.insert(events.begin() + i, ev);
+		event_pulses.insert(event_pulses.begin() + i, pulses);
+		event_usecs.insert(event_usecs.begin() + i, m_tempo_map.PulsesToMicroseconds(pulses));
+	}
+
+	const TempoMap previous = m_tempo_map;
+	if (!TempoMap::IsSmpte(m_time_division)) m_tempo_map.SetTempo(pulses, us_per_quarter_note);
+
+	RetimeAfterTempoEdit(pulses, previous);
+}
+
+bool Midi::RemoveTempoChange(unsigned long pulses)
+{
+	if (m_tracks.empty()) return false;
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(LLONG_MAX);
+
+	MidiTrack &tempo_track = m_tracks.back();
+	MidiEventList &events = tempo_track.Events();
+	MidiEventPulsesList &event_pulses = tempo_track.EventPulses();
+	MidiEventMicrosecondList &event_usecs = tempo_track.EventUsecs();
+
+	const size_t i = lower_bound(event_pulses.begin(), event_pulses.end(), pulses) - event_pulses.begin();
+	if (i == events.size() || event_pulses[i] != pulses) return false;
+
+	// The next event takes over this one's delta-time
+	if (i + 1 < events.size()) events[i + 1].SetDeltaPulses(events[i].GetDeltaPulses() + events[i + 1].GetDeltaPulses());
+
+	events.erase(events.begin() + i);
+	event_pulses.erase(event_pulses.begin() + i);
+	event_usecs.erase(event_usecs.begin() + i);
+
+	const TempoMap previous = m_tempo_map;
+	if (!TempoMap::IsSmpte(m_time_division)) m_tempo_map.RemoveTempo(pulses);
+
+	RetimeAfterTempoEdit(pulses, previous);
+
+	return true;
+}
+
+// Puts the times in 'usecs' (one per entry of the sorted 'pulses') right
+// after a tempo edit at 'edit_pulses'.  Anything up to the edit keeps its
+// time, anything past 'shift_from' just moves by 'delta', and only what's
+// left in between is converted again.
+static void retime_list(const TempoMap &tempo_map, const MidiEventPulsesList &pulses, MidiEventMicrosecondList &usecs,
+	unsigned long edit_pulses, unsigned long shift_from, microseconds_t delta)
+{
+	const size_t first = upper_bound(pulses.begin(), pulses.end(), edit_pulses) - pulses.begin();
+
+	size_t shifted = upper_bound(pulses.begin(), pulses.end(), shift_from) - pulses.begin();
+	if (shifted < first) shifted = first;
+
+	if (shifted > first) tempo_map.PulsesToMicroseconds(&pulses[first], shifted - first, &usecs[first]);
+	for (size_t i = shifted; i < usecs.size(); ++i) usecs[i] += delta;
+}
+
+void Midi::RetimeAfterTempoEdit(unsigned long pulses, const TempoMap &previous)
+{
+	const MidiTrack &tempo_track = m_tracks.back();
+	const unsigned short pulses_per_quarter_note = m_tempo_map.PulsesPerQuarterNote();
+
+	// Past the tempo changes the edit left alone, times usually just move
+	// by a constant.  Otherwise everything after the edit is converted.
+	unsigned long shift_from;
+	microseconds_t delta;
+	if (!m_tempo_map.FindShift(previous, shift_from, delta))
 	{
-		return;
+		shift_from = ULONG_MAX;
+		delta = 0;
 	}
 
-	int meter_amount;
-	int meter_unit;
-	int bar_num = 0;
+	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i) retime_list(m_tempo_map, i->EventPulses(), i->EventUsecs(), pulses, shift_from, delta);
+	for (MidiTrackList::iterator i = m_play_tracks.begin(); i != m_play_tracks.end(); ++i) retime_list(m_tempo_map, i->EventPulses(), i->EventUsecs(), pulses, shift_from, delta);
+	for (MidiTrackList::iterator i = m_mute_tracks.begin(); i != m_mute_tracks.end(); ++i) retime_list(m_tempo_map, i->EventPulses(), i->EventUsecs(), pulses, shift_from, delta);
 
-	unsigned long pulses_bar;
-	unsigned long ev_pulses;
-	unsigned long bar_pulses = 0;
+	retime_list(m_tempo_map, m_bar_pulses, m_bar_usecs, pulses, shift_from, delta);
 
-	for (size_t i = 0; i < meterTrack.Events().size(); ++i)
+	// Beats are laid out from their bar's start and meter the same way
+	// BuildBarTimeList does it, starting with the bar the edit is in
+	if (m_tracks.size() > 2 && !m_beat_grid.Empty() && !m_tracks[m_tracks.size() - 2].Events().empty())
 	{
+		const MidiTrack &meter_track = m_tracks[m_tracks.size() - 2];
+		const MidiEventPulsesList &meter_pulses = meter_track.EventPulses();
 
-		size_t last_i = i + 1;
-		if (last_i < meterTrack.Events().size())
+		size_t bar = upper_bound(m_bar_pulses.begin(), m_bar_pulses.end(), pulses) - m_bar_pulses.begin();
+		if (bar > 0) --bar;
+
+		size_t meter = 0;
+		for (; bar < m_beat_grid.BarCount() && bar < m_bar_pulses.size(); ++bar)
 		{
-			if (meterTrack.Events()[i].BeatMember() == meterTrack.Events()[last_i].BeatMember()
-				&& meterTrack.Events()[i].BeatDenominator() == meterTrack.Events()[last_i].BeatDenominator())
+			const unsigned long bar_pulses = m_bar_pulses[bar];
+			while (meter + 1 < meter_pulses.size() && meter_pulses[meter + 1] <= bar_pulses) ++meter;
+
+			const int meter_unit = meter_track.Events()[meter].BeatDenominator();
+
+			MidiBeat *beats = m_beat_grid.MutableBarBeats(bar);
+			const int beat_count = static_cast<int>(m_beat_grid.BeatCount(bar));
+			for (int j = 0; j < beat_count; ++j)
 			{
-				continue;
+				unsigned long meter_start_pulses = bar_pulses + 4 * pulses_per_quarter_note * j / meter_unit;
+				unsigned long meter_end_pulses = bar_pulses + 4 * pulses_per_quarter_note * (j + 1) / meter_unit;
+
+				if (meter_start_pulses > shift_from) beats[j].start += delta;
+				else if (meter_start_pulses > pulses) beats[j].start = m_tempo_map.PulsesToMicroseconds(meter_start_pulses);
+
+				if (meter_end_pulses > shift_from) beats[j].end += delta;
+				else if (meter_end_pulses > pulses) beats[j].end = m_tempo_map.PulsesToMicroseconds(meter_end_pulses);
 			}
 		}
+	}
 
-		meter_amount = meterTrack.Events()[i].BeatMember();
-		meter_unit = meterTrack.Events()[i].BeatDenominator();
+	// Notes before the first tempo change take its tempo as their time
+	// unit, so an edit there reaches back to the start of the song
+	const MidiEventPulsesList &tempo_pulses = tempo_track.EventPulses();
+	const unsigned long notes_from = (tempo_pulses.empty() || tempo_pulses.front() >= pulses) ? 0 : pulses;
 
-		pulses_bar = 4 * pulses_per_quarter_note * meter_amount / meter_unit;
+	// The rows past shift_from just move by delta, and the table does
+	// those itself.  Only the notes between the edit and there are
+	// converted again, with their rows looked up by their old times.
+	const MidiNoteTable &table = NoteTable();
+	const microseconds_t shift_after = (shift_from == ULONG_MAX) ? LLONG_MAX : previous.PulsesToMicroseconds(shift_from);
+	const size_t shift_row = upper_bound(table.Starts().begin(), table.Starts().end(), shift_after) - table.Starts().begin();
 
-		bar_pulses = (bar_num == 0) ? 0 : bar_pulses;// (bar_pulses + pulses_bar);
-		if (last_i >= meterTrack.Events().size())
+	vector<MidiNoteRetime> rows;
+	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i) RetimeNotes(i->SortedNotes(), notes_from, shift_after, previous, rows);
+	for (MidiTrackList::iterator i = m_mute_tracks.begin(); i != m_mute_tracks.end(); ++i) RetimeNotes(i->SortedNotes(), notes_from, shift_after, previous, rows);
+
+	// In row order, and of two notes that had the same row the first
+	// found keeps it
+	stable_sort(rows.begin(), rows.end(), [](const MidiNoteRetime &lhs, const MidiNoteRetime &rhs) { return lhs.row < rhs.row; });
+	rows.erase(unique(rows.begin(), rows.end(), [](const MidiNoteRetime &lhs, const MidiNoteRetime &rhs) { return lhs.row == rhs.row; }), rows.end());
+
+	RetimePlayNotes(rows, shift_after, delta);
+
+	// When most of the notes move, Notes() is quicker made over again in
+	// order than fixed one note at a time.  Otherwise the notes that move
+	// are taken out as they were, before the table has them moved.
+	const bool fill_note_set = rows.size() + (table.Size() - shift_row) > table.Size() / 2;
+
+	vector<TranslatedNote> old_notes;
+	if (!fill_note_set)
+	{
+		for (size_t i = 0; i < rows.size(); ++i) old_notes.push_back(table.Note(rows[i].row));
+		if (shift_row < table.Size()) old_notes.push_back(table.Note(shift_row));
+	}
+
+	// The table goes first: it decides whether the rows can stay put
+	if (m_note_table.Retime(rows, shift_row, delta))
+	{
+		if (fill_note_set)
 		{
-			break;
+			FillNoteSet();
 		}
-		ev_pulses = meterTrack.EventPulses()[last_i];
-
-		while (bar_pulses < ev_pulses)
+		else
 		{
-			MeterMicrosecondList meters_start_list;
-			MeterMicrosecondList meters_end_list;
-			for (int j = 0; j < meter_amount; ++j)
-			{
-				unsigned long meter_start_pulses = 4 * pulses_per_quarter_note * j / meter_unit;
-				meters_start_list.push_back(make_pair(j, GetEventPulseInMicroseconds(bar_pulses + meter_start_pulses, pulses_per_quarter_note)));
-				unsigned long meter_end_pulses = 4 * pulses_per_quarter_note * (j+1) / meter_unit;
-				meters_end_list.push_back(make_pair(j, GetEventPulseInMicroseconds(bar_pulses + meter_end_pulses, pulses_per_quarter_note)));
-			}
-			m_meter_start_usecs.push_back(meters_start_list);
-			m_meter_end_usecs.push_back(meters_end_list);
+			for (size_t i = 0; i < rows.size(); ++i) m_translated_notes.erase(old_notes[i]);
+			if (shift_row < table.Size()) m_translated_notes.erase(m_translated_notes.lower_bound(old_notes.back()), m_translated_notes.end());
 
-			++bar_num;
-			m_bar_pulses.push_back(bar_pulses);
-			m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
-			bar_pulses = (bar_num == 0) ? 0 : (bar_pulses + pulses_bar);
+			for (size_t i = 0; i < rows.size(); ++i) m_translated_notes.insert(table.Note(rows[i].row));
+			for (size_t row = shift_row; row < table.Size(); ++row) m_translated_notes.insert(m_translated_notes.end(), table.Note(row));
 		}
 	}
-
-	ev_pulses = FindLastNoteOffPulse();
-	while (bar_pulses <= ev_pulses)
+	else
 	{
-		MeterMicrosecondList meters_start_list;
-		MeterMicrosecondList meters_end_list;
-		for (int j = 0; j < meter_amount; ++j)
+		// Everything that moved goes back in after the rest, so a note
+		// that moves onto the old times of another isn't taken for it
+		vector<TranslatedNote> notes;
+		notes.reserve(table.Size());
+
+		vector<MidiNoteRetime>::const_iterator next = rows.begin();
+		for (size_t row = 0; row < shift_row; ++row)
 		{
-			unsigned long meter_start_pulses = 4 * pulses_per_quarter_note * j / meter_unit;
-			meters_start_list.push_back(make_pair(j, GetEventPulseInMicroseconds(bar_pulses + meter_start_pulses, pulses_per_quarter_note)));
-			unsigned long meter_end_pulses = 4 * pulses_per_quarter_note * (j + 1) / meter_unit;
-			meters_end_list.push_back(make_pair(j, GetEventPulseInMicroseconds(bar_pulses + meter_end_pulses, pulses_per_quarter_note)));
+			if (next != rows.end() && next->row == row) ++next;
+			else notes.push_back(table.Note(row));
 		}
-		m_meter_start_usecs.push_back(meters_start_list);
-		m_meter_end_usecs.push_back(meters_end_list);
 
-		++bar_num;
-		m_bar_pulses.push_back(bar_pulses);
-		m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
-		bar_pulses = (bar_num == 0) ? 0 : (bar_pulses + pulses_bar);
-	}
+		const size_t kept = notes.size();
+		for (next = rows.begin(); next != rows.end(); ++next) notes.push_back(retimed_note(table.Note(next->row), *next));
+		for (size_t row = shift_row; row < table.Size(); ++row) notes.push_back(shifted_note(table.Note(row), delta));
 
-	if (ev_pulses == m_bar_pulses.back())
-	{
-		return;
+		SetNotes(notes, kept);
 	}
 
-	m_bar_pulses.push_back(bar_pulses);
-	m_bar_usecs.push_back(GetEventPulseInMicroseconds(bar_pulses, pulses_per_quarter_note));
+	m_microsecond_base_song_length = m_note_table.Empty() ? 0 : m_note_table.Ends().back();
 
-	return;
+	BuildSongBounds(pulses_per_quarter_note, FindFirstNoteOnPulse());
+
+	// Same as the first Reset with a defer did to them
+	if (!m_first_set)
+	{
+		m_microsecond_song_end -= m_microsecond_defer;
+		m_microsecond_song_start -= m_microsecond_defer;
+	}
 }
 
-const MidiTrack Midi::FindTrack(std::string track_name)
+void Midi::RetimeNotes(const NoteList &notes, unsigned long from_pulses, microseconds_t shift_after, const TempoMap &previous,
+	vector<MidiNoteRetime> &retimed)
 {
-	MidiTrackList::iterator t = m_tracks.begin();
+	MidiBarCursor bars;
+	size_t tempo_hint = 0;
+	size_t row_hint = 0;
 
-	while (t != m_tracks.end())
+	// Starts go forward, and ends mostly do
+	size_t start_hint = 0;
+	size_t end_hint = 0;
+	size_t previous_start_hint = 0;
+	size_t previous_end_hint = 0;
+
+	for (NoteList::const_iterator i = notes.begin(); i != notes.end(); ++i)
 	{
-		if (track_name == GetTrackName(t->Events()))
-		{
-			break;
-		}
+		if (i->end < from_pulses) continue;
 
-		++t;
-	}
+		// The translated note as it was keyed before the edit
+		TranslatedNote key;
+		key.start = previous.PulsesToMicroseconds(i->start, previous_start_hint);
+		key.end = previous.PulsesToMicroseconds(i->end, previous_end_hint);
+		key.note_id = i->note_id;
+		key.channel = i->channel;
+		key.track_id = i->track_id;
 
-	return *t;
-}
+		// The rest only move by the shift (see MidiNoteTable::Retime)
+		if (key.start > shift_after) break;
 
-TranslatedNoteSet Midi::FindNotes(std::string track_name)
-{
-	TranslatedNoteSet notes;
+		// A track's rows come in its notes' order, except where two notes
+		// a pulse apart were given the same time
+		size_t row = m_note_table.FindRow(key, row_hint);
+		if (row == m_note_table.Size()) row = m_note_table.FindRow(key);
+		if (row == m_note_table.Size()) continue;
 
-	for (TranslatedNoteSet::iterator i = m_translated_notes.begin(); i != m_translated_notes.end(); ++i)
-	{
-		if (track_name == i->track_name)
-		{
-			notes.insert(*i);
-		}
+		row_hint = row;
 
-		continue;
-	}
+		MidiNoteRetime retime;
+		retime.row = row;
+		retime.start = m_tempo_map.PulsesToMicroseconds(i->start, start_hint);
+		retime.end = m_tempo_map.PulsesToMicroseconds(i->end, end_hint);
+		retime.time_unit = m_tempo_map.TempoAtMicroseconds(retime.start, tempo_hint);
+		retime.bar_id = bars.FindBar(*this, retime.start);
 
-	return notes;
+		retimed.push_back(retime);
+	}
 }
 
-int Midi::GetSongReservedBarCount(unsigned long first_note_pulses) const
+void Midi::RetimePlayNotes(const vector<MidiNoteRetime> &rows, microseconds_t shift_after, microseconds_t delta)
 {
-	int bar_sum = -1;
-	for (MidiEventPulsesList::const_iterator i = m_bar_pulses.begin(); i != m_bar_pulses.end(); ++i)
+	// PlayNotes() is a copy of one track's notes, with their state, so
+	// they move the same way the table's rows do
+	vector<TranslatedNote> moved;
+	for (TranslatedNoteSet::iterator i = m_play_notes.begin(); i != m_play_notes.end(); )
 	{
-		if ((*i) > first_note_pulses)
+		if (i->start > shift_after)
 		{
-			break;
+			moved.push_back(shifted_note(*i, delta));
 		}
+		else
+		{
+			const size_t row = m_note_table.FindRow(*i);
+			vector<MidiNoteRetime>::const_iterator found = lower_bound(rows.begin(), rows.end(), row,
+				[](const MidiNoteRetime &retime, size_t r) { return retime.row < r; });
 
-		++bar_sum;
+			if (found == rows.end() || found->row != row)
+			{
+				++i;
+				continue;
+			}
+
+			moved.push_back(retimed_note(*i, *found));
+		}
+
+		i = m_play_notes.erase(i);
 	}
 
-	return bar_sum;
+	m_play_notes.insert(moved.begin(), moved.end());
 }
 
-void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note)
+// Equal as far as the note ordering goes
+static bool same_note(const TranslatedNote &lhs, const TranslatedNote &rhs)
 {
-	for (NoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
-	{
-		TranslatedNote trans;
+	TranslatedNote less;
+	return !less(lhs, rhs) && !less(rhs, lhs);
+}
 
-		trans.note_id = i->note_id;
-		trans.track_id = i->track_id;
-		trans.channel = i->channel;
-		trans.velocity = i->velocity;
-		trans.start = GetEventPulseInMicroseconds(i->start, pulses_per_quarter_note);
-		trans.end = GetEventPulseInMicroseconds(i->end, pulses_per_quarter_note);
-		trans.time_unit = GetSongRunningTempoMicroseconds(trans.start);
-		trans.bar_id = GetBarID(trans.start);
-		trans.track_name = i->track_name;
-		trans.state = UserPlayable;
+// Sorts 'notes', the first 'sorted' of which are in order already, and
+// drops all but the first of any that are alike (the way a set keeps
+// the first one put in)
+static void sort_notes(vector<TranslatedNote> &notes, size_t sorted)
+{
+	stable_sort(notes.begin() + sorted, notes.end(), TranslatedNote());
+	inplace_merge(notes.begin(), notes.begin() + sorted, notes.end(), TranslatedNote());
+	notes.erase(unique(notes.begin(), notes.end(), same_note), notes.end());
+}
 
-		m_translated_notes.insert(trans);
-	}
+void Midi::SetNotes(vector<TranslatedNote> &notes, size_t sorted)
+{
+	sort_notes(notes, sorted);
+
+	m_note_table = MidiNoteTable(notes);
+	FillNoteSet();
 }
 
-void Midi::TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note, unsigned long first_note_pulses)
+void Midi::FillNoteSet()
 {
-	int uiMember;
-	int uiDenominator;
+	// A song with no notes doesn't need an arena for them
+	TranslatedNoteSet::allocator_type allocator;
+	if (!m_note_table.Empty()) allocator = TranslatedNoteSet::allocator_type(MidiArena::Create());
 
-	unsigned long pulses_bar;
+	// Rows are in set order, so each one goes on the end
+	TranslatedNoteSet notes(TranslatedNote(), allocator);
+	for (size_t row = 0; row < m_note_table.Size(); ++row) notes.insert(notes.end(), m_note_table.Note(row));
 
-	for (NoteSet::const_iterator i = notes.begin(); i != notes.end(); ++i)
-	{
-		TranslateRealTimeMeter(uiMember, uiDenominator, i->start);
-		pulses_bar = 4 * pulses_per_quarter_note * uiMember / uiDenominator;
+	m_translated_notes = std::move(notes);
+}
 
-		TranslatedNote trans;
+void Midi::AddNotes(vector<TranslatedNote> &notes)
+{
+	if (notes.empty()) return;
 
-		trans.note_id = i->note_id;
-		trans.track_id = i->track_id;
-		trans.channel = i->channel;
-		trans.velocity = i->velocity;
-		trans.start = GetEventPulseInMicroseconds(i->start, pulses_per_quarter_note);
-		trans.end = GetEventPulseInMicroseconds(i->end, pulses_per_quarter_note);
-		trans.time_unit = GetSongRunningTempoMicroseconds(trans.start);
-		trans.bar_id = GetBarID(trans.start);
-		trans.track_name = i->track_name;
-		trans.state = UserPlayable;
+	sort_notes(notes, 0);
 
-		m_translated_notes.insert(trans);
+	m_note_table.Merge(notes);
 
-		// --------------------------------------------------------------------------------------------------------------
+	if (!m_translated_notes.get_allocator().Arena())
+	{
+		TranslatedNoteSet note_set(m_translated_notes.begin(), m_translated_notes.end(), TranslatedNote(),
+			TranslatedNoteSet::allocator_type(MidiArena::Create()));
+		m_translated_notes = std::move(note_set);
 	}
-}
 
+	// A set keeps the one it had of two alike, the same as the table
+	m_translated_notes.insert(notes.begin(), notes.end());
+}
 
 unsigned long Midi::FindFirstNoteOnPulse()
 {
@@ -812,64 +1566,16 @@ unsigned long Midi::FindLastNoteOffPulse()
 	return last_note_pulse;
 }
 
-microseconds_t Midi::ConvertPulsesToMicroseconds(unsigned long pulses, microseconds_t tempo, unsigned short pulses_per_quarter_note)
-{
-	// Here's what we have to work with:
-	//   pulses is given
-	//   tempo is given (units of microseconds/quarter_note)
-	//   (pulses/quarter_note) is given as a constant in this object file
-	const double quarter_notes = static_cast<double>(pulses) / static_cast<double>(pulses_per_quarter_note);
-	const double microseconds = quarter_notes * static_cast<double>(tempo);
-
-	return static_cast<microseconds_t>(microseconds);
-}
-
 microseconds_t Midi::GetEventPulseInMicroseconds(unsigned long event_pulses, unsigned short pulses_per_quarter_note) const
 {
 	if (m_tracks.size() == 0) return 0;
-	const MidiTrack &tempo_track = m_tracks.back();
-
-	microseconds_t running_result = 0;
-
-	bool hit = false;
-	unsigned long last_tempo_event_pulses = 0;
-	microseconds_t running_tempo = DefaultUSTempo;
-	for (size_t i = 0; i < tempo_track.Events().size(); ++i)
-	{
-		unsigned long tempo_event_pulses = tempo_track.EventPulses()[i];
-
-		// If the time we're asking to convert is still beyond
-		// this tempo event, just add the last time slice (at
-		// the previous tempo) to the running wall-clock time.
-		unsigned long delta_pulses = 0;
-		if (event_pulses > tempo_event_pulses)
-		{
-			delta_pulses = tempo_event_pulses - last_tempo_event_pulses;
-		}
-		else
-		{
-			hit = true;
-			delta_pulses = event_pulses - last_tempo_event_pulses;
-		}
-
-		running_result += ConvertPulsesToMicroseconds(delta_pulses, running_tempo, pulses_per_quarter_note);
-
-		// If the time we're calculating is before the tempo event we're
-		// looking at, we're done.
-		if (hit) break;
-
-		running_tempo = tempo_track.Events()[i].GetTempoInUsPerQn();
-		last_tempo_event_pulses = tempo_event_pulses;
-	}
 
-	// The requested time may be after the very last tempo event
-	if (!hit)
+	if (pulses_per_quarter_note == m_tempo_map.PulsesPerQuarterNote())
 	{
-		unsigned long remaining_pulses = event_pulses - last_tempo_event_pulses;
-		running_result += ConvertPulsesToMicroseconds(remaining_pulses, running_tempo, pulses_per_quarter_note);
+		return m_tempo_map.PulsesToMicroseconds(event_pulses);
 	}
 
-	return running_result;
+	return TempoMap(m_tracks.back(), pulses_per_quarter_note).PulsesToMicroseconds(event_pulses);
 }
 
 MidiEventListWithTrackId Midi::Update(microseconds_t delta)
@@ -877,6 +1583,8 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta)
 	MidiEventListWithTrackId aggregated_events;
 	if (!m_initialized) return aggregated_events;
 
+	delta = m_playback_rate.Advance(delta);
+
 	m_microsecond_song_position += delta;
 	if (m_first_update_after_reset)
 	{
@@ -888,15 +1596,20 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta)
 	if (m_microsecond_song_position < 0) return aggregated_events;
 	if (delta > m_microsecond_song_position) delta = m_microsecond_song_position;
 
+	// Keep the decoder a bar ahead of playback
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(m_microsecond_song_position);
+
 	const size_t track_count = m_tracks.size();
 	for (size_t i = 0; i < track_count; ++i)
 	{
-		const MidiEventList &track_events = m_tracks[i].Update(delta);
+		// The track hands back a list of its own, so its events are moved
+		// out rather than copied (and their payloads counted) a second time
+		MidiEventList track_events = m_tracks[i].Update(delta);
 
 		const size_t event_count = track_events.size();
 		for (size_t j = 0; j < event_count; ++j)
 		{
-			aggregated_events.insert(aggregated_events.end(), pair<size_t, MidiEvent>(i, track_events[j]));
+			aggregated_events.push_back(pair<size_t, MidiEvent>(i, std::move(track_events[j])));
 		}
 	}
 
@@ -915,6 +1628,8 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta, bool loop)
 	{
 		return aggregated_events;
 	}
+	delta = m_playback_rate.Advance(delta);
+
 	m_microsecond_song_position += delta;
 	if (m_first_update_after_reset)
 	{
@@ -967,10 +1682,13 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta, bool loop)
 	m_microsecond_song_position = m_microsecond_song_end;
 	}*/
 
+	// Keep the decoder a bar ahead of playback
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(m_microsecond_song_position + m_microsecond_defer);
+
 	const size_t track_count = m_tracks.size();
 	for (size_t i = 0; i < track_count; ++i)
 	{
-		const MidiEventList &track_events = m_tracks[i].Update(delta, loop);
+		MidiEventList track_events = m_tracks[i].Update(delta, loop);
 
 		/*std::string name = GetTrackName(m_tracks[i].Events());
 
@@ -984,7 +1702,7 @@ MidiEventListWithTrackId Midi::Update(microseconds_t delta, bool loop)
 		for (size_t j = 0; j < event_count; ++j)
 		{
 			//track_events[j].GetTempoInUsPerQn();
-			aggregated_events.insert(aggregated_events.end(), pair<size_t, MidiEvent>(i, track_events[j]));
+			aggregated_events.push_back(pair<size_t, MidiEvent>(i, std::move(track_events[j])));
 		}
 	}
 
@@ -997,6 +1715,7 @@ void Midi::Reset(microseconds_t lead_in, microseconds_t lead_out)
 	//m_microsecond_song_position = m_microsecond_dead_start_air - lead_in;
 	m_microsecond_song_position = m_microsecond_song_start - lead_in;
 	m_first_update_after_reset = true;
+	m_playback_rate.ResetCarry();
 
 	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i) { i->Reset(); /*i->Reset(m_microsecond_song_position, m_microsecond_song_end);*/ }
 }
@@ -1006,6 +1725,7 @@ void Midi::Reset(microseconds_t lead_in, microseconds_t lead_out, microseconds_t
 	m_microsecond_lead_out = lead_out;
 	m_microsecond_song_position = hide ? m_microsecond_song_start - lead_in : -lead_in;
 	m_first_update_after_reset = true;
+	m_playback_rate.ResetCarry();
 
 	for (MidiTrackList::iterator i = m_tracks.begin(); i != m_tracks.end(); ++i)
 	{
@@ -1038,22 +1758,14 @@ void Midi::GetRealTimeMeter(unsigned int &meter_amount, unsigned int &meter_unit
 	}
 
 	const MidiTrack &meterTrack = m_tracks[m_tracks.size() - 2];
+	const MidiEventMicrosecondList &usecs = meterTrack.EventUsecs();
 
 	if (meterTrack.Events().size() > 0)
 	{
-		meter_amount = meterTrack.Events().begin()->BeatMember();
-		meter_unit = meterTrack.Events().begin()->BeatDenominator();
-	}
-
-	for (size_t i = 0; i < meterTrack.Events().size(); ++i)
-	{
-		MidiEvent ev = meterTrack.Events()[i];
-		microseconds_t ev_usecs = meterTrack.EventUsecs()[i];
-
-		if (ev_usecs > song_position)
-		{
-			break;
-		}
+		// Last meter change at or before song_position (the first one if
+		// we're before all of them)
+		const size_t next = upper_bound(usecs.begin(), usecs.end(), song_position) - usecs.begin();
+		const MidiEvent &ev = meterTrack.Events()[(next == 0) ? 0 : next - 1];
 
 		meter_amount = ev.BeatMember();
 		meter_unit = ev.BeatDenominator();
@@ -1062,45 +1774,36 @@ void Midi::GetRealTimeMeter(unsigned int &meter_amount, unsigned int &meter_unit
 	return;
 }
 
-void Midi::GetSongBarIDAndMeterID(int &bar_id, int &meter_id, microseconds_t time/* = -1*/)
+void Midi::GetSongBarIDAndMeterID(int &bar_id, int &meter_id, microseconds_t time/* = -1*/) const
+{
+	MidiBarCursor().FindBarAndMeter(*this, time, bar_id, meter_id);
+}
+
+MidiMusicalPosition Midi::GetMusicalPosition(microseconds_t time/* = -1*/) const
 {
-	bar_id = -1;
-	meter_id = 0;
+	MidiMusicalPosition position;
+	if (m_beat_grid.Empty()) return position;
 
 	if (time == -1)
 	{
 		time = m_microsecond_song_position;
 	}
 
-	if (time >= m_microsecond_song_end)
-	{
-		bar_id = m_bar_usecs.size() - 2;
-		meter_id = m_meter_start_usecs[bar_id].back().first;
+	position.pulses = m_tempo_map.MicrosecondsToPulses(time);
+	GetSongBarIDAndMeterID(position.bar_id, position.meter_id, time);
 
-		return;
-	}
+	if (static_cast<size_t>(position.bar_id) >= m_beat_grid.BarCount()) return position;
+	if (static_cast<size_t>(position.meter_id) >= m_beat_grid.BeatCount(position.bar_id)) return position;
 
-	for (MidiEventMicrosecondList::const_iterator i = m_bar_usecs.begin(); i != m_bar_usecs.end(); ++i)
+	const MidiBeat &beat = m_beat_grid.BarBeats(position.bar_id)[position.meter_id];
+	const microseconds_t beat_start = beat.start;
+	const microseconds_t beat_length = beat.end - beat_start;
+	if (beat_length > 0 && time > beat_start)
 	{
-		if ((*i) > time)
-		{
-			break;
-		}
-
-		++bar_id;
+		position.beat_fraction = min(static_cast<double>(time - beat_start) / static_cast<double>(beat_length), 1.0);
 	}
-	bar_id = (bar_id < 0) ? 0 : bar_id;
-
-	MeterMicrosecondList meter_list = m_meter_start_usecs[bar_id];
-	for (MeterMicrosecondList::const_iterator i = meter_list.begin(); i != meter_list.end(); ++i)
-	{
-		if (i->second > time)
-		{
-			break;
-		}
 
-		meter_id = i->first;
-	}
+	return position;
 }
 
 microseconds_t Midi::GetSongLengthInMicroseconds() const
@@ -1111,24 +1814,7 @@ microseconds_t Midi::GetSongLengthInMicroseconds() const
 
 microseconds_t Midi::GetSongRunningTempoMicroseconds(microseconds_t song_position /* = 0 */) const
 {
-	const MidiTrack &tempoTrack = m_tracks.back();
-
-	microseconds_t runningTempo = DefaultUSTempo;
-	if (tempoTrack.Events().size() > 0)
-	{
-		runningTempo = tempoTrack.Events().begin()->GetTempoInUsPerQn();
-	}
-
-	for (size_t i = 0; i < tempoTrack.Events().size(); ++i)
-	{
-		if (tempoTrack.EventUsecs()[i] > song_position)
-		{
-			break;
-		}
-		runningTempo = tempoTrack.Events()[i].GetTempoInUsPerQn();
-	}
-
-	return runningTempo;
+	return m_tempo_map.TempoAtMicroseconds(song_position);
 }
 
 unsigned int Midi::AggregateEventsRemain() const
@@ -1215,12 +1901,12 @@ MidiEventListWithTrackId Midi::LoadControlEvent()
 	const size_t track_count = m_tracks.size();
 	for (size_t i = 0; i < track_count; ++i)
 	{
-		const MidiEventList &track_events = m_tracks[i].LoadControlEvent();
+		MidiEventList track_events = m_tracks[i].LoadControlEvent();
 
 		const size_t event_count = track_events.size();
 		for (size_t j = 0; j < event_count; ++j)
 		{
-			aggregated_events.insert(aggregated_events.end(), std::pair<size_t, MidiEvent>(i, track_events[j]));
+			aggregated_events.push_back(std::pair<size_t, MidiEvent>(i, std::move(track_events[j])));
 		}
 	}
 
@@ -1236,20 +1922,18 @@ microseconds_t Midi::GetBarForMeterStartMicroseconds(int bar_id, size_t meter_id
 {
 	microseconds_t start = -99999;
 
-	if (m_meter_start_usecs.size() <= bar_id)
+	const size_t bar_count = m_beat_grid.BarCount();
+	if (bar_count <= bar_id)
 	{
-		start = m_meter_end_usecs[m_meter_end_usecs.size() - 1].back().second;
+		const MidiBeat *last_bar = m_beat_grid.BarBeats(bar_count - 1);
+		start = last_bar[m_beat_grid.BeatCount(bar_count - 1) - 1].end;
 		return start;
 	}
 
-	MeterMicrosecondList list = m_meter_start_usecs[bar_id];
-	for (int i = 0; i < list.size(); ++i)
+	// Beat j of a bar is always entry j
+	if (meter_id < m_beat_grid.BeatCount(bar_id))
 	{
-		if (meter_id == list[i].first)
-		{
-			start = list[i].second;
-			break;
-		}
+		start = m_beat_grid.BarBeats(bar_id)[meter_id].start;
 	}
 
 	return start;
@@ -1259,21 +1943,18 @@ microseconds_t Midi::GetBarForMeterEndMicroseconds(int bar_id, size_t meter_id)
 {
 	microseconds_t end = -99999;
 
-	if (m_meter_end_usecs.size() <= bar_id)
+	const size_t bar_count = m_beat_grid.BarCount();
+	if (bar_count <= bar_id)
 	{
-		MeterMicrosecondList list = m_meter_end_usecs[m_meter_end_usecs.size() - 1];
-		end = list.back().second + list[list.size()-1].second - list[list.size() - 2].second;
+		const MidiBeat *last_bar = m_beat_grid.BarBeats(bar_count - 1);
+		const size_t beat_count = m_beat_grid.BeatCount(bar_count - 1);
+		end = last_bar[beat_count - 1].end + last_bar[beat_count - 1].end - last_bar[beat_count - 2].end;
 		return end;
 	}
 
-	MeterMicrosecondList list = m_meter_end_usecs[bar_id];
-	for (int i = 0; i < list.size(); ++i)
+	if (meter_id < m_beat_grid.BeatCount(bar_id))
 	{
-		if (meter_id == list[i].first)
-		{
-			end = list[i].second;
-			break;
-		}
+		end = m_beat_grid.BarBeats(bar_id)[meter_id].end;
 	}
 
 	return end;
@@ -1281,19 +1962,7 @@ microseconds_t Midi::GetBarForMeterEndMicroseconds(int bar_id, size_t meter_id)
 
 unsigned int Midi::GetBarID(microseconds_t time) const
 {
-	unsigned int id = 0;
-
-	for (int i = 0; i < m_bar_usecs.size(); ++i)
-	{
-		if (time < m_bar_usecs[i])
-		{
-			break;
-		}
-
-		id = i;
-	}
-
-	return id;
+	return MidiBarCursor().FindBar(*this, time);
 }
 
 int Midi::GetSongBarCount() const
@@ -1303,19 +1972,7 @@ int Midi::GetSongBarCount() const
 
 int Midi::GetSongPositionInBarID(bool defer /* = false */) const
 {
-	int bar_id = -1;
-
-	for (MidiEventMicrosecondList::const_iterator i = m_bar_usecs.begin(); i != m_bar_usecs.end(); ++i)
-	{
-		if ((*i) > m_microsecond_song_position)
-		{
-			break;
-		}
-
-		++bar_id;
-	}
-
-	return bar_id;
+	return MidiBarCursor().FindSongPositionInBar(*this, m_microsecond_song_position);
 }
 
 unsigned int Midi::GetSongTicks(microseconds_t running_tempo) const
@@ -1382,58 +2039,71 @@ void Midi::TranslatePrivateInfo(void)
 		return;
 	}
 
-	const MidiTrack &private_track = m_tracks.front();
-	for (size_t i = 0; i < private_track.Events().size(); ++i)
+	TranslatePrivateInfo(m_tracks.front().Events());
+}
+
+void Midi::TranslatePrivateInfo(const MidiEventList &events)
+{
+	for (size_t i = 0; i < events.size(); ++i)
 	{
-		const MidiEvent &ev = private_track.Events()[i];
+		if (ParsePrivateInfo(events[i], m_private_info)) break;
+	}
 
-		if (ev.MetaType() != MidiMetaEvent_Text || !ev.HasText())
-		{
-			continue;
-		}
+	return;
+}
 
-		std::string text = ev.Text();
-		text.erase(text.find('\n'), text.substr(text.find('\n')).size());
+bool Midi::ParsePrivateInfo(const MidiEvent &ev, PrivateData &info)
+{
+	if (ev.MetaType() != MidiMetaEvent_Text || !ev.HasText())
+	{
+		return false;
+	}
 
-		std::string tempo = "Speed*";
-		std::string difficulty = "Level*";
-		std::string style = "Style*";
+	std::string text = ev.Text();
 
-		if (text.find(tempo) != std::string::npos
-			&& text.find(difficulty) != std::string::npos
-			&& text.find(style) != std::string::npos)
-		{
-			std::string temp = text;
+	// Only the first line counts.  Most text events (copyright notices
+	// and the like) don't have a second one.
+	const std::string::size_type line_end = text.find('\n');
+	if (line_end != std::string::npos) text.erase(line_end);
 
-			// ��ȡ��Ŀ�Ѷ�
-			std::size_t pos = temp.find_last_of('_');
-			if (string::npos != pos)
-			{
-				temp.erase(0, tempo.size() + pos + 1);
-				text.erase(pos, text.substr(pos).size());
-			}
-			m_private_info.difficulty = temp;
+	std::string tempo = "Speed*";
+	std::string difficulty = "Level*";
+	std::string style = "Style*";
 
-			// ��ȡ��Ŀ���
-			temp = text;
-			pos = temp.find_last_of('_');
-			if (string::npos != pos)
-			{
-				temp.erase(0, style.size() + pos + 1);
-				text.erase(pos, text.substr(pos).size());
-			}
-			m_private_info.style = temp;
+	if (text.find(tempo) == std::string::npos
+		|| text.find(difficulty) == std::string::npos
+		|| text.find(style) == std::string::npos)
+	{
+		return false;
+	}
 
-			// ��ȡ��Ŀ�ٶ�
-			temp = text;
-			temp.erase(0, difficulty.size());
-			m_private_info.tempo = temp;
+	std::string temp = text;
 
-			break;
-		}
+	// ��ȡ��Ŀ�Ѷ�
+	std::size_t pos = temp.find_last_of('_');
+	if (string::npos != pos)
+	{
+		temp.erase(0, tempo.size() + pos + 1);
+		text.erase(pos, text.substr(pos).size());
 	}
+	info.difficulty = temp;
 
-	return;
+	// ��ȡ��Ŀ���
+	temp = text;
+	pos = temp.find_last_of('_');
+	if (string::npos != pos)
+	{
+		temp.erase(0, style.size() + pos + 1);
+		text.erase(pos, text.substr(pos).size());
+	}
+	info.style = temp;
+
+	// ��ȡ��Ŀ�ٶ�
+	temp = text;
+	temp.erase(0, difficulty.size());
+	info.tempo = temp;
+
+	return true;
 }
 
 std::string Midi::GetTrackName(const MidiEventList &list) const
@@ -1506,11 +2176,14 @@ MidiEventListWithTrackId Midi::SetPlayStart(microseconds_t start_microseconds)
 {
 	MidiEventListWithTrackId aggregated_events;
 
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(start_microseconds);
+	m_playback_rate.ResetCarry();
+
 	const size_t track_count = m_tracks.size();
 	for (size_t i = 0; i < track_count; ++i)
 	{
 		m_tracks[i].SetPlayStart(start_microseconds);
-		const MidiEventList &track_events = m_tracks[i].LoadControlEvent();
+		MidiEventList track_events = m_tracks[i].LoadControlEvent();
 
 		m_microsecond_song_position = start_microseconds - m_microsecond_defer;
 
@@ -1522,7 +2195,7 @@ MidiEventListWithTrackId Midi::SetPlayStart(microseconds_t start_microseconds)
 		const size_t event_count = track_events.size();
 		for (size_t j = 0; j < event_count; ++j)
 		{
-			aggregated_events.insert(aggregated_events.end(), pair<size_t, MidiEvent>(i, track_events[j]));
+			aggregated_events.push_back(pair<size_t, MidiEvent>(i, std::move(track_events[j])));
 		}
 	}
 
@@ -1536,18 +2209,29 @@ unsigned char Midi::Channel(unsigned char status)
 
 void Midi::addPlayTrack(std::string track)
 {
+	// These pick whole tracks apart, so they need all of them
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(LLONG_MAX);
+
 	if (!isPlayNote(track))
 	{
 		m_stlPlayTrack.push_back(track);
 
 		m_play_tracks.push_back(FindTrack(track));
 
-		m_play_notes = FindNotes(track);
+		// The view is already in set order, so each insert goes
+		// straight on the end
+		const MidiNoteView notes = FindNoteView(track);
+
+		m_play_notes.clear();
+		for (size_t i = 0; i < notes.Size(); ++i) m_play_notes.insert(m_play_notes.end(), notes.Note(i));
 	}
 }
 
 void Midi::addMuteTrack(std::string track)
 {
+	// These pick whole tracks apart, so they need all of them
+	if (!IsFullyLoaded()) ContinueProgressiveLoad(LLONG_MAX);
+
 	if (!isMuteNote(track))
 	{
 		m_stlMuteTrack.push_back(track);
@@ -3,24 +3,34 @@
 
 #include <iostream>
 #include <vector>
+#include <memory>
+#include <map>
 
 #include "Note.h"
 #include "MidiTrack.h"
 #include "MidiTypes.h"
+#include "TempoMap.h"
+#include "MidiBeatGrid.h"
+#include "MidiNoteTable.h"
+#include "PlaybackRate.h"
 
 
 class MidiError;
 class MidiEvent;
+class MidiMappedFile;
+
+struct MidiTimelineScan;
 
 typedef std::vector<MidiTrack> MidiTrackList;
 
 typedef std::vector<MidiEvent> MidiEventList;
 typedef std::vector<std::pair<size_t, MidiEvent> > MidiEventListWithTrackId;
 
-typedef std::vector<std::pair<size_t, microseconds_t> > MeterMicrosecondList;
-
 typedef std::vector<double> NoteArray;
 
+// Track chunk bodies (start of the body, body length) within a file
+typedef std::vector<std::pair<const unsigned char*, size_t> > MidiChunkList;
+
 enum LoopMode
 {
 	LoopBtoA,
@@ -35,6 +45,124 @@ struct PrivateData
 	std::string difficulty;
 };
 
+// Knobs for the loader.  The defaults load exactly the way
+// ReadFromFile(filename) always has.
+struct MidiReadOptions
+{
+	MidiReadOptions() : worker_count(1) { }
+
+	// Number of threads used to decode and post-process tracks once
+	// the chunk boundaries are known.  1 decodes on the calling thread,
+	// 0 uses one thread per core.  Track order never depends on this.
+	unsigned int worker_count;
+
+	// When set, ReadFromFile (and ReadManyFromFiles) look here for a
+	// precompiled copy of the song (see MidiCache) before parsing it,
+	// and leave one behind when they had to parse.  The directory has to
+	// exist already.  Problems with the cache never fail a load; the
+	// song is just parsed the usual way.
+	std::string cache_directory;
+};
+
+// Knobs for Midi::ReadManyFromFiles.
+struct MidiBatchOptions
+{
+	MidiBatchOptions() : worker_count(0), memory_limit(0) { }
+
+	// Number of files loaded at once.  0 uses one thread per core.
+	unsigned int worker_count;
+
+	// Ceiling (in bytes) on the estimated working memory of the loads
+	// that are in flight at the same time.  A file is only started once
+	// its estimate fits under the ceiling next to the others, though a
+	// single file is always allowed to run on its own.  0 means no limit.
+	//
+	// This bounds the transient cost of decoding, not the total size of
+	// the songs handed back.
+	size_t memory_limit;
+
+	// Passed through to each individual load
+	MidiReadOptions read_options;
+};
+
+// Decode progress of a song opened with Midi::BeginProgressiveLoad
+struct MidiProgressiveState
+{
+	MidiProgressiveState() : pulses_per_quarter_note(0), loaded_pulses(0) { }
+
+	// The tracks are decoded straight out of the mapped file, so it has
+	// to stay around until they're done.  It's never written to, so
+	// copies of a Midi can share it.
+	std::shared_ptr<MidiMappedFile> file;
+
+	// One per file track (the meter and tempo tracks are built up front)
+	std::vector<MidiTrackDecodeState> tracks;
+
+	unsigned short pulses_per_quarter_note;
+
+	// Every track has been decoded up to (and including) this pulse
+	unsigned long loaded_pulses;
+};
+
+// Which parts of a MidiSummary to fill in.  The fewer you ask for,
+// the less of the file has to be read.
+enum MidiSummaryField
+{
+	// Only reads the first track, up to its PrivateData text event
+	MidiSummary_PrivateInfo = 0x01,
+
+	// Reads each track up to its name
+	MidiSummary_TrackNames = 0x02,
+
+	// Bar count and song length.  Reads every track to the end (and
+	// fills in everything else on the way).
+	MidiSummary_Timing = 0x04,
+
+	MidiSummary_All = 0x07
+};
+
+// What a song browser wants to know about a file, without loading it
+// (see Midi::ReadSummaryFromFile)
+struct MidiSummary
+{
+	MidiSummary() : pulses_per_quarter_note(0), bar_count(0), song_length(0) { }
+
+	PrivateData private_info;
+
+	// One per track chunk in the file
+	std::vector<std::string> track_names;
+
+	// SMPTE time comes out as its equivalent (see TempoMap)
+	unsigned short pulses_per_quarter_note;
+
+	// Same as GetSongBarCount() on the loaded song
+	int bar_count;
+
+	// Same as GetSongLengthInMicroseconds() on the loaded song, give or
+	// take the tail of overlapping final notes
+	microseconds_t song_length;
+};
+
+// Where a point in song time falls musically (see
+// Midi::GetMusicalPosition)
+struct MidiMusicalPosition
+{
+	MidiMusicalPosition() : pulses(0), bar_id(0), meter_id(0), beat_fraction(0.0) { }
+
+	// Last pulse that has started by then
+	unsigned long pulses;
+
+	// Same as GetSongBarIDAndMeterID
+	int bar_id;
+	int meter_id;
+
+	// How far through that beat, from 0 to 1
+	double beat_fraction;
+};
+
+struct MidiLoadResult;
+typedef std::vector<MidiLoadResult> MidiLoadResultList;
+
 // NOTE: This library's MIDI loading and handling is destructive.  Perfect
 //       1:1 serialization routines will not be possible without quite a
 //       bit of additional work.
@@ -51,7 +179,40 @@ class Midi
 public:
 
 	static Midi ReadFromFile(std::string filename);
+	static Midi ReadFromFile(std::string filename, const MidiReadOptions &options);
 	static Midi ReadFromStream(std::istream &stream);
+	static Midi ReadFromStream(std::istream &stream, const MidiReadOptions &options);
+
+	// Decodes a complete MIDI (or RIFF MIDI) file that is already in
+	// memory.  Tracks are decoded in place; nothing is copied out of
+	// the buffer.  ReadFromFile maps the file and comes through here.
+	static Midi ReadFromMemory(const unsigned char *data, size_t length);
+	static Midi ReadFromMemory(const unsigned char *data, size_t length, const MidiReadOptions &options);
+
+
+	// Loads a whole list of files on a fixed number of threads.  One
+	// bad file doesn't stop the batch: every file gets a result, and the
+	// results come back in the same order as 'filenames'.
+	static MidiLoadResultList ReadManyFromFiles(const std::vector<std::string> &filenames, const MidiBatchOptions &options);
+
+
+	// Progressive loading for big files, so playback can start before
+	// the whole file is decoded.
+	//
+	// BeginProgressiveLoad makes one quick pass over the file that only
+	// keeps tempo and time signature events.  The meter and tempo tracks,
+	// bar times, song start/end and lead-in are ready as soon as it
+	// returns, but every other track starts out empty.
+	//
+	// ContinueProgressiveLoad then decodes all tracks up to (at least)
+	// song time 'until', appending their events and translated notes in
+	// time order.  It returns true once the whole file is in.  Update()
+	// and SetPlayStart() keep the decoded part ahead of the play position
+	// on their own, so it only needs calling to load ahead during idle
+	// time.
+	static Midi BeginProgressiveLoad(std::string filename);
+	bool ContinueProgressiveLoad(microseconds_t until);
+	bool IsFullyLoaded() const { return !m_progressive.file; }
 
 
 	static Midi LinkMidi(vector<std::string> files);
@@ -59,6 +220,11 @@ public:
 
 	static Midi ReadPrivateInfoFromFile(std::string filename);
 
+	// Reads just enough of the file to fill in 'fields' (any mix of
+	// MidiSummaryField values).  No tracks, events or notes are kept.
+	static MidiSummary ReadSummaryFromFile(std::string filename, unsigned int fields = MidiSummary_All);
+	static MidiSummary ReadSummaryFromMemory(const unsigned char *data, size_t length, unsigned int fields = MidiSummary_All);
+
 
 	PrivateData PrivateInfo() { return m_private_info; }
 
@@ -75,27 +241,70 @@ public:
 	const std::vector<MidiTrack> &MuteTracks() const { return m_mute_tracks; }
 
 
+	// The same notes as NoteTable(), as a set.  It's kept up to date along
+	// with the table, so this is only a getter.
 	const TranslatedNoteSet &Notes() const { return m_translated_notes; }
 
 
+	// A copy of the notes of the track(s) called 'track_name'
 	TranslatedNoteSet FindNotes(std::string track_name);
 
+	// The same notes as a view of NoteTable(), with nothing copied.  The
+	// view points into this Midi's table, so it's only good until the
+	// notes next change here (a ContinueProgressiveLoad step, a tempo
+	// edit, assigning another song over this one) or this Midi goes.
+	// Copies of the Midi have tables of their own; ask them for theirs.
+	MidiNoteView FindNoteView(const std::string &track_name) const { return m_note_table.FindTrack(track_name); }
+
 
 	TranslatedNoteSet &PlayNotes() { return m_play_notes; }
 
 
+	// The song's notes, as a table of columns for walking over in bulk
+	// (see MidiNoteTable).  Loading, each ContinueProgressiveLoad step
+	// and tempo edits bring it (and Notes()) up to date before they
+	// return, so reading it is safe as long as nothing is changing the
+	// song at the same time.
+	const MidiNoteTable &NoteTable() const { return m_note_table; }
+
+	// PlayNotes() as a view of NoteTable() (without the notes' states).
+	// Good for as long as a FindNoteView one would be.
+	MidiNoteView PlayNoteView() const { return m_stlPlayTrack.empty() ? MidiNoteView() : FindNoteView(m_stlPlayTrack.back()); }
+
+
+	// 'delta' is transport (wall clock) time; the song moves on by that
+	// much scaled by the playback rate
 	MidiEventListWithTrackId Update(microseconds_t delta);
 	MidiEventListWithTrackId Update(microseconds_t delta, bool loop);
 
 
+	// Playback speed, 1.0 being the song's own tempo.  With a ramp the
+	// rate slides there linearly over that much transport time.  Event
+	// and note times are all still in song time; only the clock driving
+	// Update() changes, so this is O(1).
+	void SetPlaybackRate(double rate, microseconds_t ramp_microseconds = 0) { m_playback_rate.SetRate(rate, ramp_microseconds); }
+
+	const PlaybackRate &GetPlaybackRate() const { return m_playback_rate; }
+
+
 	void Reset(microseconds_t lead_in, microseconds_t lead_out);
 	void Reset(microseconds_t lead_in, microseconds_t lead, microseconds_t defer, bool hide = false);
 
 
+	// For a position that keeps moving (playback), a TimelineCursor gives
+	// this, the running tempo, bar and beat together in O(1)
 	void GetRealTimeMeter(unsigned int &meter_amount, unsigned int &meter_unit, microseconds_t song_position = -1);
 
 
-	void GetSongBarIDAndMeterID(int &bar_id, int &meter_id, microseconds_t time = -1);
+	// Binary searches the bar and beat start times.  For a position that
+	// keeps moving forward (playback), a MidiBarCursor does the same
+	// lookups in O(1).
+	void GetSongBarIDAndMeterID(int &bar_id, int &meter_id, microseconds_t time = -1) const;
+
+	// Pulse, bar, beat and how far into the beat song time 'time' is (the
+	// current song position by default).  O(log n) in the number of bars
+	// and tempo changes.
+	MidiMusicalPosition GetMusicalPosition(microseconds_t time = -1) const;
 
 
 	microseconds_t GetSongPositionInMicroseconds() const { return m_microsecond_song_position; }
@@ -106,8 +315,27 @@ public:
 	microseconds_t GetDeadAirStartOffsetMicroseconds() const { return m_microsecond_dead_start_air; }
 
 
+	// Tempo (microseconds per quarter note) at 'song_position'.  SMPTE
+	// files ignore tempo events, so this is always the fixed tempo they're
+	// mapped onto: 1,000,000 (1,001,000 at 29.97 drop-frame), see TempoMap.
 	microseconds_t GetSongRunningTempoMicroseconds(microseconds_t song_position = 0) const;
 
+	// Pulse <-> song time conversions for this song's tempo changes
+	const TempoMap &GetTempoMap() const { return m_tempo_map; }
+
+	// Tempo editing.  SetTempoChange puts a tempo change (microseconds per
+	// quarter note) at 'pulses', replacing any already there, and
+	// RemoveTempoChange takes one out (false if there wasn't one).
+	//
+	// Only the event, bar, beat and note times after 'pulses' are worked
+	// out again, and past the next tempo change they usually just move by
+	// however much the edited stretch grew or shrank (see
+	// TempoMap::FindShift), so an edit near the end of a song is cheap.
+	// The song position isn't touched; SetPlayStart or Reset before
+	// playing on.  Not for songs put together with LinkMidi.
+	void SetTempoChange(unsigned long pulses, microseconds_t us_per_quarter_note);
+	bool RemoveTempoChange(unsigned long pulses);
+
 
 	microseconds_t GetSongStartMicroseconds() const { return m_microsecond_song_start; }
 
@@ -146,13 +374,11 @@ public:
 	unsigned short GetMidiTimeDivision(void) { return m_time_division; }
 
 
-	MidiEventMicrosecondList GetMidiBarStartUsecs(void) { return m_bar_usecs; }
-
-
-	vector<MeterMicrosecondList> GetMidiMeterStartUsecs(void) { return m_meter_start_usecs; }
+	const MidiEventMicrosecondList &GetMidiBarStartUsecs(void) const { return m_bar_usecs; }
 
 
-	vector<MeterMicrosecondList> GetMidiMeterEndUsecs(void) { return m_meter_end_usecs; }
+	// Start and end of every beat of every bar
+	const MidiBeatGrid &GetMidiBeatGrid(void) const { return m_beat_grid; }
 
 
 	void addPlayTrack(std::string track);
@@ -192,20 +418,21 @@ public:
 	unsigned int AggregateNotesRemain() const;
 	unsigned int AggregateNoteCount() const;
 
-	MidiEventMicrosecondList GetBarUsecs();
+	const MidiEventMicrosecondList &GetBarUsecs() const;
 private:
-	const static unsigned long DefaultBPM = 120;
+	// Reads and writes the fully derived song (see MidiCache.h)
+	friend class MidiCache;
+	friend class MidiBarCursor;
+	friend class TimelineCursor;
+
 	const static microseconds_t OneMinuteInMicroseconds = 60000000;
-	const static microseconds_t DefaultUSTempo = OneMinuteInMicroseconds / DefaultBPM;
 
-	static microseconds_t ConvertPulsesToMicroseconds(unsigned long pulses, microseconds_t tempo, unsigned short pulses_per_quarter_note);
 
 	Midi(): m_initialized(false), m_microsecond_dead_start_air(0), m_microsecond_song_start(0), m_init_meter_amount(0), m_init_meter_unit(0),
 		m_microsecond_init_running_tempo(0), m_microsecond_defer(0), m_reserved_bars(0), m_first_set(true) { Reset(0, 0); }
 
-	// This is O(n) where n is the number of tempo changes (across all tracks) in
-	// the song up to the specified time.  Tempo changes are usually a small number.
-	// (Almost always 0 or 1, going up to maybe 30-100 in rare cases.)
+	// A binary search over the tempo changes (see TempoMap).  Only builds a
+	// throwaway map when asked for a time division other than the song's.
 	microseconds_t GetEventPulseInMicroseconds(unsigned long event_pulses, unsigned short pulses_per_quarter_note) const;
 
 
@@ -215,6 +442,10 @@ private:
 
 
 	void TranslatePrivateInfo(void);
+	void TranslatePrivateInfo(const MidiEventList &events);
+
+	// Returns true if 'ev' is the PrivateData text event
+	static bool ParsePrivateInfo(const MidiEvent &ev, PrivateData &info);
 
 
 	std::string GetTrackName(const MidiEventList &list) const;
@@ -228,13 +459,85 @@ private:
 
 	void BuildTempoTrack();
 
-	void BuildBarTimeList(unsigned short pulses_per_quarter_note);
+	// Appends a track holding 'events' (keyed by absolute pulse), with
+	// their delta-times worked out again.
+	void AppendTrackFromEvents(const std::map<unsigned long, MidiEvent> &events);
+
+	void BuildBarTimeList(unsigned short pulses_per_quarter_note, unsigned long last_note_pulses);
+
+	// Checks the file header and finds the body of every track chunk
+	// (or just the first max_chunks of them)
+	static void FindTrackChunks(const unsigned char *data, size_t length, unsigned short &time_division, MidiChunkList &chunks,
+		size_t max_chunks = static_cast<size_t>(-1));
+
+	// Decodes every track chunk into m_tracks, in chunk order, spreading
+	// the work over worker_count threads.
+	void ReadTracks(const MidiChunkList &chunks, unsigned int worker_count);
+
+	// ReadFromMemory, going through options.cache_directory when it's set
+	static Midi ReadThroughCache(const unsigned char *data, size_t length, const MidiReadOptions &options);
+
+	// Everything we work out from the raw tracks once they're loaded:
+	// meter/tempo tracks, bar times, event times and translated notes.
+	void BuildDerivedData(unsigned short pulses_per_quarter_note);
+
+	// Song start/end, lead-in and starting tempo, once the bar times and
+	// tempo track are in place.
+	void BuildSongBounds(unsigned short pulses_per_quarter_note, unsigned long first_note_pulses);
+
+	// Fills in EventUsecs() for the events from 'first_event' onward
+	void BuildEventUsecs(MidiTrack &track, size_t first_event, unsigned short pulses_per_quarter_note) const;
+
+	// Walks every track chunk once without keeping its events.  Leaves
+	// m_tracks as one empty track per chunk followed by the meter and
+	// tempo tracks, exactly where BuildMeterTrack/BuildTempoTrack would
+	// have put them.
+	void ScanTimeline(const MidiChunkList &chunks, MidiTimelineScan &scan);
+
+	// ScanTimeline, then everything that can be worked out without the
+	// notes themselves: private info, bar times, meter/tempo event
+	// times, track names and song bounds.  Expects m_time_division set.
+	void LoadTimeline(const MidiChunkList &chunks, MidiTimelineScan &scan);
+
+	void FinishProgressiveLoad();
 
 
 	int GetSongReservedBarCount(unsigned long first_note_pulses) const;
 
-	void TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note);
-	void TranslateNotes(const NoteSet &notes, unsigned short pulses_per_quarter_note, unsigned long first_note_pulses);
+	// Appends the translated 'notes' (all from the track called
+	// 'track_name') to 'translated'
+	void TranslateNotes(const NoteList &notes, const std::string &track_name, unsigned short pulses_per_quarter_note,
+		std::vector<TranslatedNote> &translated);
+	void TranslateNotes(const NoteList &notes, const std::string &track_name, unsigned short pulses_per_quarter_note,
+		unsigned long first_note_pulses, std::vector<TranslatedNote> &translated);
+
+	// Makes 'notes' the song's notes.  Only the first 'sorted' of them
+	// have to be in order, and of two alike the first is kept.
+	void SetNotes(std::vector<TranslatedNote> &notes, size_t sorted = 0);
+
+	// Makes Notes() over again from m_note_table
+	void FillNoteSet();
+
+	// Adds 'notes' (in any order) to the song's notes.  Of two alike the
+	// one already there, or else the first, is kept.
+	void AddNotes(std::vector<TranslatedNote> &notes);
+
+	// Brings everything the tempo track times up to date after an edit
+	// at 'pulses' (the tempo track and m_tempo_map already edited).
+	// 'previous' is the tempo map from before the edit.
+	void RetimeAfterTempoEdit(unsigned long pulses, const TempoMap &previous);
+
+	// Re-translates the notes in 'notes' still sounding at 'from_pulses'
+	// or later, up to the ones that started after 'shift_after' under
+	// 'previous'.  Each one's row (looked up by what 'previous' made of
+	// it) goes in 'retimed' with its new times.
+	void RetimeNotes(const NoteList &notes, unsigned long from_pulses, microseconds_t shift_after, const TempoMap &previous,
+		std::vector<MidiNoteRetime> &retimed);
+
+	// Gives PlayNotes() the times of their rows in 'rows' (in row order),
+	// and moves the ones after 'shift_after' by 'delta'.  The table has to
+	// have the old times still.
+	void RetimePlayNotes(const std::vector<MidiNoteRetime> &rows, microseconds_t shift_after, microseconds_t delta);
 
 	NoteId StandardizingDrumNoteId(NoteId id);														// ��׼�����ӹĵ�������
 
@@ -248,12 +551,17 @@ private:
 	MidiEventPulsesList m_bar_pulses;
 	MidiEventMicrosecondList m_bar_usecs;
 
-	vector<MeterMicrosecondList> m_meter_start_usecs;
-	vector<MeterMicrosecondList> m_meter_end_usecs;
+	MidiBeatGrid m_beat_grid;
 
+	// Notes(), the same notes as m_note_table.  Its arena is made along
+	// with the first notes put in it.
 	TranslatedNoteSet m_translated_notes;
+
 	TranslatedNoteSet m_play_notes;
 
+	// Where the song's notes are kept (see NoteTable)
+	MidiNoteTable m_note_table;
+
 	// Position can be negative (for lead-in).
 	microseconds_t m_microsecond_song_position;
 	microseconds_t m_microsecond_base_song_length;
@@ -281,10 +589,33 @@ private:
 	bool m_first_set;
 
 	bool m_first_update_after_reset;
-	double m_playback_speed;
+
+	MidiProgressiveState m_progressive;
+
+	// Built along with the tempo track, answers every pulse to
+	// microsecond conversion
+	TempoMap m_tempo_map;
+
+	// Maps Update() deltas (transport time) onto song time
+	PlaybackRate m_playback_rate;
+
 	MidiTrackList m_tracks;
 	MidiTrackList m_play_tracks;
 	MidiTrackList m_mute_tracks;
 };
 
+// Outcome of loading one file with Midi::ReadManyFromFiles
+struct MidiLoadResult
+{
+	std::string filename;
+
+	bool success;
+
+	// Why the load failed (only meaningful when success is false)
+	MidiErrorCode error;
+
+	// The loaded song (an empty Midi when success is false)
+	Midi midi;
+};
+
 #endif
@@ -0,0 +1,74 @@
+#include "MidiArena.h"
+
+#include <cstdlib>
+#include <new>
+
+// Enough for anything the standard containers put in here
+const static size_t MidiArenaAlignment = 16;
+
+const static size_t MidiArenaFirstBlockSize = 4 * 1024;
+const static size_t MidiArenaLargestBlockSize = 1024 * 1024;
+
+static size_t size_class(size_t size)
+{
+	return (size + MidiArenaAlignment - 1) / MidiArenaAlignment;
+}
+
+MidiArena::MidiArena() : m_position(NULL), m_end(NULL), m_next_block_size(MidiArenaFirstBlockSize), m_reserved_bytes(0),
+	m_free_lists(size_class(LargestPiece) + 1, static_cast<void*>(NULL))
+{
+}
+
+MidiArena::~MidiArena()
+{
+	for (size_t i = 0; i < m_blocks.size(); ++i) free(m_blocks[i]);
+}
+
+void *MidiArena::Allocate(size_t size)
+{
+	if (size > LargestPiece) return ::operator new(size);
+
+	const size_t piece_class = size_class(size);
+
+	void *&free_list = m_free_lists[piece_class];
+	if (free_list != NULL)
+	{
+		void *piece = free_list;
+		free_list = *static_cast<void**>(piece);
+		return piece;
+	}
+
+	const size_t piece_size = piece_class * MidiArenaAlignment;
+	if (static_cast<size_t>(m_end - m_position) < piece_size)
+	{
+		// Whatever is left of the old block is simply abandoned
+		void *block = malloc(m_next_block_size);
+		if (block == NULL) throw std::bad_alloc();
+
+		m_blocks.push_back(block);
+		m_position = static_cast<unsigned char*>(block);
+		m_end = m_position + m_next_block_size;
+		m_reserved_bytes += m_next_block_size;
+
+		if (m_next_block_size < MidiArenaLargestBlockSize) m_next_block_size *= 2;
+	}
+
+	void *piece = m_position;
+	m_position += piece_size;
+	return piece;
+}
+
+void MidiArena::Deallocate(void *p, size_t size)
+{
+	if (p == NULL) return;
+
+	if (size > LargestPiece)
+	{
+		::operator delete(p);
+		return;
+	}
+
+	void *&free_list = m_free_lists[size_class(size)];
+	*static_cast<void**>(p) = free_list;
+	free_list = p;
+}
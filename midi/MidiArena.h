@@ -0,0 +1,153 @@
+#ifndef __MIDI_ARENA_H
+#define __MIDI_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+#include <type_traits>
+
+// Hands out memory from a few large blocks instead of one heap
+// allocation per object.  Everything goes back in one shot when the
+// arena is destroyed.  Freed pieces are kept on per-size free lists, so
+// containers that erase and re-insert (see Midi::SetTempoChange) don't
+// keep growing it.
+//
+// An arena isn't thread safe.  Each one only ever backs the containers
+// and event payloads of a single track (or song), which are never
+// modified concurrently.
+class MidiArena
+{
+public:
+	// Anything bigger comes straight from the heap.  Set nodes and event
+	// text are all well under this.
+	const static size_t LargestPiece = 1024;
+
+	MidiArena();
+	~MidiArena();
+
+	static std::shared_ptr<MidiArena> Create() { return std::make_shared<MidiArena>(); }
+
+	void *Allocate(size_t size);
+	void Deallocate(void *p, size_t size);
+
+	// Bytes taken from the heap so far (for diagnostics)
+	size_t ReservedBytes() const { return m_reserved_bytes; }
+
+private:
+	MidiArena(const MidiArena &);
+	MidiArena &operator=(const MidiArena &);
+
+	std::vector<void*> m_blocks;
+	unsigned char *m_position;
+	unsigned char *m_end;
+
+	size_t m_next_block_size;
+	size_t m_reserved_bytes;
+
+	// Head of a singly linked list of freed pieces, one per size class
+	std::vector<void*> m_free_lists;
+};
+
+// Standard allocator over a shared MidiArena.  A default constructed
+// allocator (no arena) just uses the heap, so plain note sets still
+// work the way they always have.
+//
+// Copying a container gives the copy a fresh arena of its own rather
+// than sharing the original's; moving or swapping takes the arena
+// along with the elements.
+template <class T>
+class MidiArenaAllocator
+{
+public:
+	typedef T value_type;
+
+	typedef std::false_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	MidiArenaAllocator() { }
+	explicit MidiArenaAllocator(const std::shared_ptr<MidiArena> &arena) : m_arena(arena) { }
+
+	template <class U>
+	MidiArenaAllocator(const MidiArenaAllocator<U> &other) : m_arena(other.Arena()) { }
+
+	T *allocate(size_t n)
+	{
+		if (!m_arena) return static_cast<T*>(::operator new(n * sizeof(T)));
+		return static_cast<T*>(m_arena->Allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (!m_arena) ::operator delete(p);
+		else m_arena->Deallocate(p, n * sizeof(T));
+	}
+
+	MidiArenaAllocator select_on_container_copy_construction() const
+	{
+		return m_arena ? MidiArenaAllocator(MidiArena::Create()) : MidiArenaAllocator();
+	}
+
+	const std::shared_ptr<MidiArena> &Arena() const { return m_arena; }
+
+private:
+	std::shared_ptr<MidiArena> m_arena;
+};
+
+template <class T, class U>
+bool operator==(const MidiArenaAllocator<T> &lhs, const MidiArenaAllocator<U> &rhs) { return lhs.Arena() == rhs.Arena(); }
+
+template <class T, class U>
+bool operator!=(const MidiArenaAllocator<T> &lhs, const MidiArenaAllocator<U> &rhs) { return lhs.Arena() != rhs.Arena(); }
+
+// Like MidiArenaAllocator, except nothing freed goes back to the arena:
+// it stays where it is until the arena itself goes.  This is for things
+// that may be let go of on any thread (see MidiEventPayload).  Only the
+// thread filling an arena ever touches its free lists or blocks, so
+// dropping the last reference elsewhere is still safe.
+//
+// Copies of a container always go to the heap, so the arena only ever
+// grows while a track is being read.
+template <class T>
+class MidiArenaBumpAllocator
+{
+public:
+	typedef T value_type;
+
+	typedef std::false_type propagate_on_container_copy_assignment;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+
+	MidiArenaBumpAllocator() { }
+	explicit MidiArenaBumpAllocator(const std::shared_ptr<MidiArena> &arena) : m_arena(arena) { }
+
+	template <class U>
+	MidiArenaBumpAllocator(const MidiArenaBumpAllocator<U> &other) : m_arena(other.Arena()) { }
+
+	T *allocate(size_t n)
+	{
+		if (!m_arena) return static_cast<T*>(::operator new(n * sizeof(T)));
+		return static_cast<T*>(m_arena->Allocate(n * sizeof(T)));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		if (!m_arena) ::operator delete(p);
+		else if (n * sizeof(T) > MidiArena::LargestPiece) ::operator delete(p);
+	}
+
+	MidiArenaBumpAllocator select_on_container_copy_construction() const { return MidiArenaBumpAllocator(); }
+
+	const std::shared_ptr<MidiArena> &Arena() const { return m_arena; }
+
+private:
+	std::shared_ptr<MidiArena> m_arena;
+};
+
+template <class T, class U>
+bool operator==(const MidiArenaBumpAllocator<T> &lhs, const MidiArenaBumpAllocator<U> &rhs) { return lhs.Arena() == rhs.Arena(); }
+
+template <class T, class U>
+bool operator!=(const MidiArenaBumpAllocator<T> &lhs, const MidiArenaBumpAllocator<U> &rhs) { return lhs.Arena() != rhs.Arena(); }
+
+#endif
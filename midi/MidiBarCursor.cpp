@@ -0,0 +1,78 @@
+#include "MidiBarCursor.h"
+#include "Midi.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// How far a cursor walks forward before deciding this is a seek
+const static size_t MidiBarCursorMaxSteps = 4;
+
+int MidiBarCursor::SeekBar(const Midi &midi, microseconds_t time)
+{
+	const MidiEventMicrosecondList &bars = midi.m_bar_usecs;
+	if (bars.empty() || time < bars[0])
+	{
+		m_bar_index = 0;
+		return -1;
+	}
+
+	if (m_bar_index < bars.size() && bars[m_bar_index] <= time)
+	{
+		for (size_t step = 0; step < MidiBarCursorMaxSteps; ++step)
+		{
+			if (m_bar_index + 1 >= bars.size() || time < bars[m_bar_index + 1]) return static_cast<int>(m_bar_index);
+			++m_bar_index;
+		}
+	}
+
+	m_bar_index = (upper_bound(bars.begin(), bars.end(), time) - bars.begin()) - 1;
+	return static_cast<int>(m_bar_index);
+}
+
+unsigned int MidiBarCursor::FindBar(const Midi &midi, microseconds_t time)
+{
+	return max(SeekBar(midi, time), 0);
+}
+
+int MidiBarCursor::FindSongPositionInBar(const Midi &midi, microseconds_t time)
+{
+	return SeekBar(midi, time);
+}
+
+void MidiBarCursor::FindBarAndMeter(const Midi &midi, microseconds_t time, int &bar_id, int &meter_id)
+{
+	if (time == -1)
+	{
+		time = midi.m_microsecond_song_position;
+	}
+
+	const MidiBeatGrid &grid = midi.m_beat_grid;
+
+	if (time >= midi.m_microsecond_song_end)
+	{
+		bar_id = midi.m_bar_usecs.size() - 2;
+		meter_id = static_cast<int>(grid.BeatCount(bar_id)) - 1;
+
+		return;
+	}
+
+	const size_t previous_bar = m_bar_index;
+	bar_id = max(SeekBar(midi, time), 0);
+	if (m_bar_index != previous_bar) m_meter_index = 0;
+
+	meter_id = 0;
+	const MidiBeat *beats = grid.BarBeats(bar_id);
+	const size_t beat_count = grid.BeatCount(bar_id);
+	if (beat_count == 0 || time < beats[0].start)
+	{
+		m_meter_index = 0;
+		return;
+	}
+
+	// Bars only have a handful of beats, so just walk
+	if (m_meter_index >= beat_count || time < beats[m_meter_index].start) m_meter_index = 0;
+	while (m_meter_index + 1 < beat_count && beats[m_meter_index + 1].start <= time) ++m_meter_index;
+
+	meter_id = static_cast<int>(m_meter_index);
+}
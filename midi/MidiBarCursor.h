@@ -0,0 +1,44 @@
+#ifndef __MIDI_BAR_CURSOR_H
+#define __MIDI_BAR_CURSOR_H
+
+#include <cstddef>
+
+#include "MidiTypes.h"
+
+class Midi;
+
+// Bar and beat lookups for a position that mostly moves forward a little
+// at a time (playback, or walking notes in start order).  Remembers the
+// bar and beat it found last and steps on from there, so each lookup is
+// O(1) while the position creeps forward; a seek (backward, or further
+// than a few bars ahead) falls back to a binary search.
+//
+// Answers are always the same as the Midi methods named below.  A
+// cursor holds no reference to the song: pass the same song each time,
+// and after the song is reloaded, Reset() (or just keep going; stale
+// hints are checked and searched past).
+class MidiBarCursor
+{
+public:
+	MidiBarCursor() : m_bar_index(0), m_meter_index(0) { }
+
+	void Reset() { m_bar_index = 0; m_meter_index = 0; }
+
+	// Same as midi.GetBarID(time)
+	unsigned int FindBar(const Midi &midi, microseconds_t time);
+
+	// Same as midi.GetSongBarIDAndMeterID(bar_id, meter_id, time)
+	void FindBarAndMeter(const Midi &midi, microseconds_t time, int &bar_id, int &meter_id);
+
+	// Same as midi.GetSongPositionInBarID(): -1 before the first bar
+	int FindSongPositionInBar(const Midi &midi, microseconds_t time);
+
+private:
+	// Index of the last bar start at or before 'time' (-1 if none)
+	int SeekBar(const Midi &midi, microseconds_t time);
+
+	size_t m_bar_index;
+	size_t m_meter_index;
+};
+
+#endif
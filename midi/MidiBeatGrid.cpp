@@ -0,0 +1,44 @@
+#include "MidiBeatGrid.h"
+
+void MidiBeatGrid::Clear()
+{
+	m_beats.clear();
+	m_bar_offsets.assign(1, 0);
+}
+
+void MidiBeatGrid::Reserve(size_t bar_count, size_t beat_count)
+{
+	m_bar_offsets.reserve(bar_count + 1);
+	m_beats.reserve(beat_count);
+}
+
+void MidiBeatGrid::AddBar()
+{
+	m_bar_offsets.push_back(m_beats.size());
+}
+
+void MidiBeatGrid::AddBeat(microseconds_t start, microseconds_t end)
+{
+	MidiBeat beat = { start, end };
+	m_beats.push_back(beat);
+
+	// The last bar always ends at the end of the beat list
+	m_bar_offsets.back() = m_beats.size();
+}
+
+void MidiBeatGrid::Append(const MidiBeatGrid &other, microseconds_t start_offset, microseconds_t end_offset)
+{
+	const size_t first_beat = m_beats.size();
+
+	m_beats.reserve(first_beat + other.m_beats.size());
+	for (size_t i = 0; i < other.m_beats.size(); ++i)
+	{
+		MidiBeat beat = { other.m_beats[i].start + start_offset, other.m_beats[i].end + end_offset };
+		m_beats.push_back(beat);
+	}
+
+	for (size_t i = 1; i < other.m_bar_offsets.size(); ++i)
+	{
+		m_bar_offsets.push_back(first_beat + other.m_bar_offsets[i]);
+	}
+}
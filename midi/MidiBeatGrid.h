@@ -0,0 +1,57 @@
+#ifndef __MIDI_BEAT_GRID_H
+#define __MIDI_BEAT_GRID_H
+
+#include <cstddef>
+#include <vector>
+
+#include "MidiTypes.h"
+
+struct MidiBeat
+{
+	microseconds_t start;
+	microseconds_t end;
+};
+
+// Start and end time of every beat of every bar, in one array.  Bar b's
+// beats are BarBeats(b)[0] up to BarBeats(b)[BeatCount(b) - 1], with the
+// bar's beat (meter id) j always at index j.  BarOffsets() has one entry
+// per bar plus one, so the whole grid can be walked without touching
+// anything but these two arrays.
+//
+// A beat ends where the next one starts in a song read from a file, but
+// not after LinkMidi, which shifts the linked song's starts and ends by
+// different amounts, so both are kept.
+class MidiBeatGrid
+{
+public:
+	MidiBeatGrid() : m_bar_offsets(1, 0) { }
+
+	void Clear();
+	void Reserve(size_t bar_count, size_t beat_count);
+
+	// Starts a new bar; AddBeat adds beats to the last bar started
+	void AddBar();
+	void AddBeat(microseconds_t start, microseconds_t end);
+
+	// Appends every bar of 'other', with its times moved by the given
+	// amounts
+	void Append(const MidiBeatGrid &other, microseconds_t start_offset, microseconds_t end_offset);
+
+	bool Empty() const { return BarCount() == 0; }
+	size_t BarCount() const { return m_bar_offsets.size() - 1; }
+
+	size_t BeatCount(size_t bar) const { return m_bar_offsets[bar + 1] - m_bar_offsets[bar]; }
+	const MidiBeat *BarBeats(size_t bar) const { return m_beats.data() + m_bar_offsets[bar]; }
+	MidiBeat *MutableBarBeats(size_t bar) { return m_beats.data() + m_bar_offsets[bar]; }
+
+	const std::vector<MidiBeat> &Beats() const { return m_beats; }
+	const std::vector<size_t> &BarOffsets() const { return m_bar_offsets; }
+
+private:
+	friend class MidiCache;
+
+	std::vector<MidiBeat> m_beats;
+	std::vector<size_t> m_bar_offsets;
+};
+
+#endif
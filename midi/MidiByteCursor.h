@@ -0,0 +1,73 @@
+#ifndef __MIDI_BYTE_CURSOR_H
+#define __MIDI_BYTE_CURSOR_H
+
+#include <cstddef>
+
+#include "MidiUtil.h"
+
+// A bounds-checked read position over a contiguous range of bytes
+// (a mapped file, a track chunk, a single event...).  This is what the
+// event decoder runs on instead of an istream: every read is a pointer
+// compare and a load.
+//
+// Running off the end of the range throws MidiError(MidiError_EventTooShort).
+// The cursor never owns the bytes it walks.
+class MidiByteCursor
+{
+public:
+	MidiByteCursor(const unsigned char *data, size_t length) : m_begin(data), m_position(data), m_end(data + length) { }
+
+	bool AtEnd() const { return m_position >= m_end; }
+	size_t Remaining() const { return static_cast<size_t>(m_end - m_position); }
+	size_t Offset() const { return static_cast<size_t>(m_position - m_begin); }
+	const unsigned char *Position() const { return m_position; }
+
+	unsigned char PeekByte() const
+	{
+		if (m_position >= m_end) throw MidiError(MidiError_EventTooShort);
+		return *m_position;
+	}
+
+	unsigned char ReadByte()
+	{
+		if (m_position >= m_end) throw MidiError(MidiError_EventTooShort);
+		return *m_position++;
+	}
+
+	// Returns a pointer to the next 'count' bytes (still owned by
+	// whoever owns the range) and moves past them.
+	const unsigned char *ReadBytes(size_t count)
+	{
+		if (Remaining() < count) throw MidiError(MidiError_EventTooShort);
+
+		const unsigned char *bytes = m_position;
+		m_position += count;
+		return bytes;
+	}
+
+	void Skip(size_t count) { ReadBytes(count); }
+
+	// MIDI contains these wacky variable length numbers where
+	// the value is stored only in the first 7 bits of each
+	// byte, and the last bit is a kind of "keep going" flag.
+	// (See parse_variable_length for the istream version.)
+	unsigned long ReadVariableLength()
+	{
+		unsigned long value = 0;
+		unsigned char c;
+		do
+		{
+			c = ReadByte();
+			value = (value << 7) + (c & 0x7F);
+		} while (c & 0x80);
+
+		return value;
+	}
+
+private:
+	const unsigned char *m_begin;
+	const unsigned char *m_position;
+	const unsigned char *m_end;
+};
+
+#endif
@@ -0,0 +1,799 @@
+#include "MidiCache.h"
+#include "MidiMappedFile.h"
+#include "MidiUtil.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <atomic>
+#include <cstring>
+#include <cstdio>
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+
+using namespace std;
+
+// Bump this whenever anything below (or the meaning of anything stored)
+// changes.  Old caches are then rejected and rebuilt.
+const static uint32_t MidiCacheVersion = 8;
+
+const static char MidiCacheMagic[4] = { 'M', 'I', 'D', 'C' };
+
+// Written in native order; reads back differently on the wrong machine
+const static uint32_t MidiCacheByteOrderMark = 0x01020304;
+
+// Every section starts on this boundary so records can be used in place
+const static size_t MidiCacheAlignment = 8;
+
+enum MidiCacheSectionId
+{
+	MidiCacheSection_Song,
+	MidiCacheSection_Tracks,
+	MidiCacheSection_Events,
+	MidiCacheSection_Payloads,
+	MidiCacheSection_EventPulses,
+	MidiCacheSection_EventUsecs,
+	MidiCacheSection_TrackNotes,
+	MidiCacheSection_TempoSegments,
+	MidiCacheSection_BarPulses,
+	MidiCacheSection_BarUsecs,
+	MidiCacheSection_BarBeatOffsets,
+	MidiCacheSection_Beats,
+
+	// MidiNoteTable, a section per column
+	MidiCacheSection_NoteStarts,
+	MidiCacheSection_NoteEnds,
+	MidiCacheSection_NoteIds,
+	MidiCacheSection_NoteVelocities,
+	MidiCacheSection_NoteChannels,
+	MidiCacheSection_NoteTrackIds,
+	MidiCacheSection_NoteBarIds,
+	MidiCacheSection_NoteTimeUnits,
+	MidiCacheSection_NoteMaxEnds,
+	MidiCacheSection_NoteNames,
+	MidiCacheSection_NoteTrackNameIds,
+	MidiCacheSection_NoteNameOffsets,
+	MidiCacheSection_NoteNameRows,
+
+	MidiCacheSection_Strings,
+
+	MidiCacheSection_Count
+};
+
+struct MidiCacheSection
+{
+	uint64_t offset;
+	uint64_t count;
+	uint32_t element_size;
+	uint32_t reserved;
+};
+
+struct MidiCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t header_size;
+
+	MidiCacheSection sections[MidiCacheSection_Count];
+};
+
+// A run of bytes in the Strings section
+struct MidiCacheString
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct MidiCacheSong
+{
+	int64_t base_song_length;
+	int64_t dead_start_air;
+	int64_t song_start;
+	int64_t song_end;
+	int64_t init_running_tempo;
+
+	uint32_t reserved_bars;
+	uint32_t init_ticks;
+	int32_t init_meter_amount;
+	int32_t init_meter_unit;
+	uint32_t time_division;
+	uint32_t tempo_map_pulses_per_quarter_note;
+
+	MidiCacheString tempo;
+	MidiCacheString style;
+	MidiCacheString difficulty;
+};
+
+struct MidiCacheTrack
+{
+	MidiCacheString name;
+
+	// Ranges in the Events/EventPulses/EventUsecs and TrackNotes sections
+	uint64_t first_event;
+	uint64_t event_count;
+	uint64_t first_note;
+	uint64_t note_count;
+
+	int32_t instrument_id;
+	uint32_t reserved;
+};
+
+// No payload (see MidiCacheEvent)
+const static uint32_t MidiCacheNoPayload = 0xFFFFFFFF;
+
+// A MidiEvent, with its payload as an index in the Payloads section.
+// Events that share a payload in memory (every channel message of a
+// track shares one with its name, see MidiEvent::ShareTrackName) share
+// the record.
+struct MidiCacheEvent
+{
+	uint32_t delta_pulses;
+	uint32_t payload;
+
+	uint8_t status;
+	uint8_t data1;
+	uint8_t data2;
+	uint8_t reserved;
+};
+
+struct MidiCachePayload
+{
+	uint32_t tempo_uspqn;
+	uint8_t meta_type;
+	uint8_t reserved[3];
+
+	MidiCacheString text;
+	MidiCacheString other_data;
+	MidiCacheString track_name;
+};
+
+namespace
+{
+	// Lays the sections out one after another behind the header
+	class MidiCacheWriter
+	{
+	public:
+		MidiCacheWriter(vector<unsigned char> &out) : m_out(out)
+		{
+			memset(&m_header, 0, sizeof(m_header));
+			memcpy(m_header.magic, MidiCacheMagic, sizeof(m_header.magic));
+			m_header.version = MidiCacheVersion;
+			m_header.byte_order = MidiCacheByteOrderMark;
+			m_header.header_size = sizeof(MidiCacheHeader);
+
+			m_out.assign(sizeof(MidiCacheHeader), 0);
+		}
+
+		// Same string, same bytes: every event in a track shares one copy
+		// of the track name.
+		MidiCacheString String(const string &s)
+		{
+			MidiCacheString ref = { 0, static_cast<uint32_t>(s.size()) };
+			if (s.empty()) return ref;
+
+			map<string, uint32_t>::const_iterator i = m_string_offsets.find(s);
+			if (i != m_string_offsets.end())
+			{
+				ref.offset = i->second;
+				return ref;
+			}
+
+			ref.offset = static_cast<uint32_t>(m_strings.size());
+			m_strings.insert(m_strings.end(), s.begin(), s.end());
+			m_string_offsets[s] = ref.offset;
+
+			return ref;
+		}
+
+		MidiCacheString Text(const MidiEventText &text)
+		{
+			return String(string(text.begin(), text.end()));
+		}
+
+		MidiCacheString Bytes(const MidiEventData &bytes)
+		{
+			return String(string(bytes.begin(), bytes.end()));
+		}
+
+		template <class T>
+		void Section(MidiCacheSectionId id, const T *items, size_t count)
+		{
+			while (m_out.size() % MidiCacheAlignment != 0) m_out.push_back(0);
+
+			MidiCacheSection &section = m_header.sections[id];
+			section.offset = m_out.size();
+			section.count = count;
+			section.element_size = sizeof(T);
+
+			if (count == 0) return;
+
+			const unsigned char *bytes = reinterpret_cast<const unsigned char*>(items);
+			m_out.insert(m_out.end(), bytes, bytes + count * sizeof(T));
+		}
+
+		template <class T>
+		void Section(MidiCacheSectionId id, const vector<T> &items)
+		{
+			Section(id, items.empty() ? NULL : &items[0], items.size());
+		}
+
+		template <class T>
+		void Section(MidiCacheSectionId id, const MidiNoteColumn<T> &column)
+		{
+			Section(id, column.data(), column.size());
+		}
+
+		void Finish()
+		{
+			Section(MidiCacheSection_Strings, m_strings);
+			memcpy(&m_out[0], &m_header, sizeof(m_header));
+		}
+
+	private:
+		vector<unsigned char> &m_out;
+		MidiCacheHeader m_header;
+
+		vector<char> m_strings;
+		map<string, uint32_t> m_string_offsets;
+	};
+
+	// The payloads read so far, by index in the Payloads section, and how
+	// many events share each.  The counts are stored once at the end (or
+	// when reading gives up part way) instead of with an atomic increment
+	// per event.
+	class MidiCachePayloadTable
+	{
+	public:
+		explicit MidiCachePayloadTable(size_t count) : m_payloads(count, NULL), m_sharers(count, 0) { }
+
+		~MidiCachePayloadTable()
+		{
+			for (size_t i = 0; i < m_payloads.size(); ++i)
+			{
+				if (m_payloads[i]) m_payloads[i]->references.store(m_sharers[i], memory_order_release);
+			}
+		}
+
+		size_t Size() const { return m_payloads.size(); }
+
+		// NULL until Add
+		MidiEventPayload *Find(size_t id) const { return m_payloads[id]; }
+
+		// Takes over 'payload', which nobody shares yet
+		void Add(size_t id, MidiEventPayload *payload)
+		{
+			m_payloads[id] = payload;
+			m_sharers[id] = 0;
+		}
+
+		MidiEventPayload *Share(size_t id)
+		{
+			++m_sharers[id];
+			return m_payloads[id];
+		}
+
+	private:
+		vector<MidiEventPayload*> m_payloads;
+		vector<unsigned int> m_sharers;
+	};
+
+	// Bounds-checked access to the sections of a cache in memory
+	class MidiCacheReader
+	{
+	public:
+		MidiCacheReader(const unsigned char *data, size_t length) : m_data(data), m_length(length)
+		{
+			if (length < sizeof(MidiCacheHeader)) throw MidiError(MidiError_BadCacheFile);
+			if (reinterpret_cast<size_t>(data) % MidiCacheAlignment != 0) throw MidiError(MidiError_BadCacheFile);
+
+			m_header = reinterpret_cast<const MidiCacheHeader*>(data);
+			if (memcmp(m_header->magic, MidiCacheMagic, sizeof(MidiCacheMagic)) != 0) throw MidiError(MidiError_BadCacheFile);
+
+			if (m_header->version != MidiCacheVersion) throw MidiError(MidiError_StaleCacheFile);
+			if (m_header->byte_order != MidiCacheByteOrderMark) throw MidiError(MidiError_StaleCacheFile);
+			if (m_header->header_size != sizeof(MidiCacheHeader)) throw MidiError(MidiError_StaleCacheFile);
+
+			const MidiCacheSection &strings = m_header->sections[MidiCacheSection_Strings];
+			m_strings = Section<char>(MidiCacheSection_Strings);
+			m_string_length = static_cast<size_t>(strings.count);
+		}
+
+		template <class T>
+		const T *Section(MidiCacheSectionId id) const
+		{
+			const MidiCacheSection &section = m_header->sections[id];
+
+			if (section.element_size != sizeof(T)) throw MidiError(MidiError_StaleCacheFile);
+			if (section.offset % MidiCacheAlignment != 0) throw MidiError(MidiError_BadCacheFile);
+			if (section.offset > m_length) throw MidiError(MidiError_BadCacheFile);
+			if (section.count > (m_length - section.offset) / sizeof(T)) throw MidiError(MidiError_BadCacheFile);
+
+			return reinterpret_cast<const T*>(m_data + section.offset);
+		}
+
+		size_t Count(MidiCacheSectionId id) const { return static_cast<size_t>(m_header->sections[id].count); }
+
+		string String(const MidiCacheString &ref) const
+		{
+			return string(Chars(ref), ref.length);
+		}
+
+		// The string's bytes in place, checked to be inside the strings
+		const char *Chars(const MidiCacheString &ref) const
+		{
+			if (ref.offset > m_string_length || ref.length > m_string_length - ref.offset) throw MidiError(MidiError_BadCacheFile);
+			return m_strings + ref.offset;
+		}
+
+		// Checks that [first, first + count) lies inside a section
+		void CheckRange(MidiCacheSectionId id, uint64_t first, uint64_t count) const
+		{
+			const uint64_t available = m_header->sections[id].count;
+			if (first > available || count > available - first) throw MidiError(MidiError_BadCacheFile);
+		}
+
+	private:
+		const unsigned char *m_data;
+		size_t m_length;
+
+		const MidiCacheHeader *m_header;
+
+		const char *m_strings;
+		size_t m_string_length;
+	};
+}
+
+static bool same_string(const MidiCacheString &lhs, const MidiCacheString &rhs)
+{
+	return lhs.offset == rhs.offset && lhs.length == rhs.length;
+}
+
+// A name that's the track's own (all of them, after a normal load)
+// shares the track's MidiTrackName instead of getting a copy.  Equal
+// strings were written once, so equal names have equal refs.
+static MidiTrackName read_track_name(const MidiCacheReader &reader, const MidiCacheString &name, const MidiCacheString &track_ref, const MidiTrackName &track_name)
+{
+	if (same_string(name, track_ref)) return track_name;
+	return MidiTrackName(reader.String(name));
+}
+
+static void read_payload(const MidiCacheReader &reader, const MidiCachePayload &record, const MidiCacheString &track_ref,
+	const MidiTrackName &track_name, MidiEventPayload &payload)
+{
+	payload.meta_type = record.meta_type;
+	payload.tempo_uspqn = record.tempo_uspqn;
+	payload.text.assign(reader.Chars(record.text), record.text.length);
+
+	const unsigned char *other_data = reinterpret_cast<const unsigned char*>(reader.Chars(record.other_data));
+	payload.other_data.assign(other_data, other_data + record.other_data.length);
+
+	payload.track_name = read_track_name(reader, record.track_name, track_ref, track_name);
+}
+
+// Points 'column' at section 'id' of the mapped file if there is one,
+// otherwise copies the section.  Either way it's one step, not one per
+// row.
+template <class T>
+static void read_column(const MidiCacheReader &reader, MidiCacheSectionId id, size_t count, bool borrow, MidiNoteColumn<T> &column)
+{
+	const T *values = reader.Section<T>(id);
+	if (reader.Count(id) != count) throw MidiError(MidiError_BadCacheFile);
+
+	if (borrow)
+	{
+		column.Borrow(values, count);
+		return;
+	}
+
+	vector<T> copy(values, values + count);
+	column.Own(copy);
+}
+
+void MidiCache::WriteToMemory(const Midi &midi, vector<unsigned char> &out)
+{
+	if (!midi.m_initialized || !midi.IsFullyLoaded()) throw MidiError(MidiError_CacheWriteFailed);
+
+	MidiCacheWriter writer(out);
+
+	MidiCacheSong song;
+	memset(&song, 0, sizeof(song));
+	song.base_song_length = midi.m_microsecond_base_song_length;
+	song.dead_start_air = midi.m_microsecond_dead_start_air;
+	song.song_start = midi.m_microsecond_song_start;
+	song.song_end = midi.m_microsecond_song_end;
+	song.init_running_tempo = midi.m_microsecond_init_running_tempo;
+	song.reserved_bars = midi.m_reserved_bars;
+	song.init_ticks = midi.m_init_ticks;
+	song.init_meter_amount = midi.m_init_meter_amount;
+	song.init_meter_unit = midi.m_init_meter_unit;
+	song.time_division = midi.m_time_division;
+	song.tempo_map_pulses_per_quarter_note = midi.m_tempo_map.m_pulses_per_quarter_note;
+	song.tempo = writer.String(midi.m_private_info.tempo);
+	song.style = writer.String(midi.m_private_info.style);
+	song.difficulty = writer.String(midi.m_private_info.difficulty);
+
+	vector<MidiCacheTrack> tracks;
+	vector<MidiCacheEvent> events;
+	vector<MidiCachePayload> payloads;
+	map<const MidiEventPayload*, uint32_t> payload_ids;
+	MidiEventPulsesList event_pulses;
+	MidiEventMicrosecondList event_usecs;
+	NoteList track_notes;
+
+	for (MidiTrackList::const_iterator t = midi.m_tracks.begin(); t != midi.m_tracks.end(); ++t)
+	{
+		MidiCacheTrack track;
+		memset(&track, 0, sizeof(track));
+		track.name = writer.String(t->m_track_name);
+		track.first_event = events.size();
+		track.event_count = t->m_events.size();
+		track.first_note = track_notes.size();
+		track.note_count = t->m_notes.size();
+		track.instrument_id = t->m_instrument_id;
+		tracks.push_back(track);
+
+		for (size_t i = 0; i < t->m_events.size(); ++i)
+		{
+			const MidiEvent &ev = t->m_events[i];
+
+			MidiCacheEvent event;
+			memset(&event, 0, sizeof(event));
+			event.delta_pulses = ev.m_delta_pulses;
+			event.payload = MidiCacheNoPayload;
+			event.status = ev.m_status;
+			event.data1 = ev.m_data1;
+			event.data2 = ev.m_data2;
+
+			if (ev.m_payload)
+			{
+				map<const MidiEventPayload*, uint32_t>::const_iterator known = payload_ids.find(ev.m_payload);
+				if (known != payload_ids.end())
+				{
+					event.payload = known->second;
+				}
+				else
+				{
+					const MidiEventPayload &payload = *ev.m_payload;
+
+					MidiCachePayload record;
+					memset(&record, 0, sizeof(record));
+					record.tempo_uspqn = static_cast<uint32_t>(payload.tempo_uspqn);
+					record.meta_type = payload.meta_type;
+					record.text = writer.Text(payload.text);
+					record.other_data = writer.Bytes(payload.other_data);
+					record.track_name = writer.String(payload.track_name);
+
+					event.payload = static_cast<uint32_t>(payloads.size());
+					payload_ids[ev.m_payload] = event.payload;
+					payloads.push_back(record);
+				}
+			}
+
+			events.push_back(event);
+		}
+
+		event_pulses.insert(event_pulses.end(), t->m_event_pulses.begin(), t->m_event_pulses.end());
+		event_usecs.insert(event_usecs.end(), t->m_event_usecs.begin(), t->m_event_usecs.end());
+
+		track_notes.insert(track_notes.end(), t->m_notes.begin(), t->m_notes.end());
+	}
+
+	const MidiNoteTable &table = midi.NoteTable();
+	vector<MidiCacheString> note_names;
+	for (size_t i = 0; i < table.m_track_names.size(); ++i) note_names.push_back(writer.String(table.m_track_names[i]));
+
+	writer.Section(MidiCacheSection_Song, vector<MidiCacheSong>(1, song));
+	writer.Section(MidiCacheSection_Tracks, tracks);
+	writer.Section(MidiCacheSection_Events, events);
+	writer.Section(MidiCacheSection_Payloads, payloads);
+	writer.Section(MidiCacheSection_EventPulses, event_pulses);
+	writer.Section(MidiCacheSection_EventUsecs, event_usecs);
+	writer.Section(MidiCacheSection_TrackNotes, track_notes);
+	writer.Section(MidiCacheSection_TempoSegments, midi.m_tempo_map.m_segments);
+	writer.Section(MidiCacheSection_BarPulses, midi.m_bar_pulses);
+	writer.Section(MidiCacheSection_BarUsecs, midi.m_bar_usecs);
+	writer.Section(MidiCacheSection_BarBeatOffsets, midi.m_beat_grid.m_bar_offsets);
+	writer.Section(MidiCacheSection_Beats, midi.m_beat_grid.m_beats);
+
+	writer.Section(MidiCacheSection_NoteStarts, table.m_starts);
+	writer.Section(MidiCacheSection_NoteEnds, table.m_ends);
+	writer.Section(MidiCacheSection_NoteIds, table.m_note_ids);
+	writer.Section(MidiCacheSection_NoteVelocities, table.m_velocities);
+	writer.Section(MidiCacheSection_NoteChannels, table.m_channels);
+	writer.Section(MidiCacheSection_NoteTrackIds, table.m_track_ids);
+	writer.Section(MidiCacheSection_NoteBarIds, table.m_bar_ids);
+	writer.Section(MidiCacheSection_NoteTimeUnits, table.m_time_units);
+	writer.Section(MidiCacheSection_NoteMaxEnds, table.m_max_ends);
+	writer.Section(MidiCacheSection_NoteNames, note_names);
+	writer.Section(MidiCacheSection_NoteTrackNameIds, table.m_track_name_ids);
+	writer.Section(MidiCacheSection_NoteNameOffsets, table.m_name_offsets);
+	writer.Section(MidiCacheSection_NoteNameRows, table.m_name_rows);
+	writer.Finish();
+}
+
+// A name next to 'filename' that no other writer (in this process or
+// another) is using at the same time
+static string temporary_filename(const string &filename)
+{
+	static atomic<unsigned int> counter(0);
+
+#ifdef _WIN32
+	const unsigned long process_id = GetCurrentProcessId();
+#else
+	const unsigned long process_id = static_cast<unsigned long>(getpid());
+#endif
+
+	return STRING(filename << ".tmp." << process_id << "." << counter++);
+}
+
+// Moves 'from' over 'to', replacing whatever was there in one step
+static bool replace_file(const string &from, const string &to)
+{
+#ifdef _WIN32
+	return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+void MidiCache::WriteToFile(const Midi &midi, const string &filename)
+{
+	vector<unsigned char> bytes;
+	WriteToMemory(midi, bytes);
+
+	const string temporary = temporary_filename(filename);
+
+	fstream file(temporary.c_str(), ios::out | ios::binary | ios::trunc);
+	if (!file.good()) throw MidiError(MidiError_CacheWriteFailed);
+
+	file.write(reinterpret_cast<const char*>(&bytes[0]), static_cast<streamsize>(bytes.size()));
+	file.close();
+
+	if (file.fail() || !replace_file(temporary, filename))
+	{
+		remove(temporary.c_str());
+		throw MidiError(MidiError_CacheWriteFailed);
+	}
+}
+
+string MidiCache::CacheFilename(const string &directory, const unsigned char *data, size_t length)
+{
+	// 64-bit FNV-1a
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < length; ++i)
+	{
+		hash ^= data[i];
+		hash *= 1099511628211ULL;
+	}
+
+	char name[64];
+	sprintf(name, "%016llx-%llu.v%u.midc", static_cast<unsigned long long>(hash), static_cast<unsigned long long>(length), MidiCacheVersion);
+
+	if (directory.empty()) return name;
+
+	const char last = directory[directory.size() - 1];
+	if (last == '/' || last == '\\') return directory + name;
+
+	return directory + "/" + name;
+}
+
+Midi MidiCache::ReadFromMemory(const unsigned char *data, size_t length)
+{
+	return Read(data, length, shared_ptr<MidiMappedFile>());
+}
+
+Midi MidiCache::Read(const unsigned char *data, size_t length, const shared_ptr<MidiMappedFile> &mapping)
+{
+	MidiCacheReader reader(data, length);
+
+	if (reader.Count(MidiCacheSection_Song) != 1) throw MidiError(MidiError_BadCacheFile);
+	const MidiCacheSong &song = *reader.Section<MidiCacheSong>(MidiCacheSection_Song);
+
+	Midi m;
+	m.m_microsecond_base_song_length = song.base_song_length;
+	m.m_microsecond_dead_start_air = song.dead_start_air;
+	m.m_microsecond_song_start = song.song_start;
+	m.m_microsecond_song_end = song.song_end;
+	m.m_microsecond_init_running_tempo = song.init_running_tempo;
+	m.m_reserved_bars = song.reserved_bars;
+	m.m_init_ticks = song.init_ticks;
+	m.m_init_meter_amount = song.init_meter_amount;
+	m.m_init_meter_unit = song.init_meter_unit;
+	m.m_time_division = static_cast<unsigned short>(song.time_division);
+	m.m_private_info.tempo = reader.String(song.tempo);
+	m.m_private_info.style = reader.String(song.style);
+	m.m_private_info.difficulty = reader.String(song.difficulty);
+
+	const MidiCacheTrack *tracks = reader.Section<MidiCacheTrack>(MidiCacheSection_Tracks);
+	const MidiCacheEvent *events = reader.Section<MidiCacheEvent>(MidiCacheSection_Events);
+	const MidiCachePayload *payload_records = reader.Section<MidiCachePayload>(MidiCacheSection_Payloads);
+	const unsigned long *event_pulses = reader.Section<unsigned long>(MidiCacheSection_EventPulses);
+	const microseconds_t *event_usecs = reader.Section<microseconds_t>(MidiCacheSection_EventUsecs);
+	const MidiTrackNote *track_notes = reader.Section<MidiTrackNote>(MidiCacheSection_TrackNotes);
+
+	const size_t event_count = reader.Count(MidiCacheSection_Events);
+	if (reader.Count(MidiCacheSection_EventPulses) != event_count) throw MidiError(MidiError_BadCacheFile);
+	if (reader.Count(MidiCacheSection_EventUsecs) != event_count) throw MidiError(MidiError_BadCacheFile);
+
+	// Each payload is made the first time an event points at it, in that
+	// event's track's arena, and the rest of its events just share it
+	MidiCachePayloadTable payloads(reader.Count(MidiCacheSection_Payloads));
+
+	const size_t track_count = reader.Count(MidiCacheSection_Tracks);
+	m.m_tracks.assign(track_count, MidiTrack::CreateBlankTrack());
+	for (size_t i = 0; i < track_count; ++i)
+	{
+		const MidiCacheTrack &track = tracks[i];
+		reader.CheckRange(MidiCacheSection_Events, track.first_event, track.event_count);
+		reader.CheckRange(MidiCacheSection_TrackNotes, track.first_note, track.note_count);
+
+		const size_t first_event = static_cast<size_t>(track.first_event);
+		const size_t last_event = first_event + static_cast<size_t>(track.event_count);
+
+		MidiTrack &t = m.m_tracks[i];
+		t.m_track_name = MidiTrackName(reader.String(track.name));
+		t.m_instrument_id = track.instrument_id;
+
+		// Nothing to decode: each event is its three bytes, its
+		// delta-time and a shared payload
+		t.m_events.resize(last_event - first_event);
+		for (size_t j = first_event; j < last_event; ++j)
+		{
+			const MidiCacheEvent &event = events[j];
+
+			MidiEvent &ev = t.m_events[j - first_event];
+			ev.m_delta_pulses = event.delta_pulses;
+			ev.SetStatus(event.status);
+			ev.m_data1 = event.data1;
+			ev.m_data2 = event.data2;
+
+			if (event.payload == MidiCacheNoPayload) continue;
+			if (event.payload >= payloads.Size()) throw MidiError(MidiError_BadCacheFile);
+
+			if (!payloads.Find(event.payload))
+			{
+				// Let go of again if the record turns out to be bad
+				MidiEvent holder;
+				holder.m_payload = MidiEvent::NewPayload(t.Arena());
+				read_payload(reader, payload_records[event.payload], track.name, t.m_track_name, *holder.m_payload);
+
+				payloads.Add(event.payload, holder.m_payload);
+				holder.m_payload = NULL;
+			}
+
+			ev.m_payload = payloads.Share(event.payload);
+		}
+
+		// Stored the same as in memory, so these are block copies
+		t.m_event_pulses.assign(event_pulses + first_event, event_pulses + last_event);
+		t.m_event_usecs.assign(event_usecs + first_event, event_usecs + last_event);
+
+		const MidiTrackNote *first_note = track_notes + track.first_note;
+		t.m_notes.assign(first_note, first_note + track.note_count);
+
+		for (size_t j = 1; j < t.m_notes.size(); ++j)
+		{
+			if (!MidiTrackNote()(t.m_notes[j - 1], t.m_notes[j])) throw MidiError(MidiError_BadCacheFile);
+		}
+
+		t.FillNoteSet();
+		t.Reset();
+	}
+
+	const unsigned long *bar_pulses = reader.Section<unsigned long>(MidiCacheSection_BarPulses);
+	const microseconds_t *bar_usecs = reader.Section<microseconds_t>(MidiCacheSection_BarUsecs);
+	m.m_bar_pulses.assign(bar_pulses, bar_pulses + reader.Count(MidiCacheSection_BarPulses));
+	m.m_bar_usecs.assign(bar_usecs, bar_usecs + reader.Count(MidiCacheSection_BarUsecs));
+
+	const size_t *bar_beat_offsets = reader.Section<size_t>(MidiCacheSection_BarBeatOffsets);
+	const MidiBeat *beats = reader.Section<MidiBeat>(MidiCacheSection_Beats);
+	const size_t offset_count = reader.Count(MidiCacheSection_BarBeatOffsets);
+	const size_t beat_count = reader.Count(MidiCacheSection_Beats);
+	if (offset_count == 0 || bar_beat_offsets[0] != 0 || bar_beat_offsets[offset_count - 1] != beat_count) throw MidiError(MidiError_BadCacheFile);
+
+	// One per bar, so this check is cheap
+	for (size_t i = 1; i < offset_count; ++i)
+	{
+		if (bar_beat_offsets[i] < bar_beat_offsets[i - 1]) throw MidiError(MidiError_BadCacheFile);
+	}
+
+	MidiBeatGrid &grid = m.m_beat_grid;
+	grid.m_bar_offsets.assign(bar_beat_offsets, bar_beat_offsets + offset_count);
+	grid.m_beats.assign(beats, beats + beat_count);
+
+	// The tempo track is always last.  It has at least the one segment
+	// for the start of the song.
+	const TempoMap::Segment *segments = reader.Section<TempoMap::Segment>(MidiCacheSection_TempoSegments);
+	const size_t segment_count = reader.Count(MidiCacheSection_TempoSegments);
+	if (!m.m_tracks.empty() && segment_count == 0) throw MidiError(MidiError_BadCacheFile);
+
+	m.m_tempo_map.m_segments.assign(segments, segments + segment_count);
+	m.m_tempo_map.m_pulses_per_quarter_note = static_cast<unsigned short>(song.tempo_map_pulses_per_quarter_note);
+
+	// The note table is used right out of the mapped file when there is
+	// one, which the table then keeps open
+	MidiNoteTable &table = m.m_note_table;
+	const bool borrow = static_cast<bool>(mapping);
+	if (borrow) table.m_mapping = mapping;
+
+	const size_t row_count = reader.Count(MidiCacheSection_NoteStarts);
+	read_column(reader, MidiCacheSection_NoteStarts, row_count, borrow, table.m_starts);
+	read_column(reader, MidiCacheSection_NoteEnds, row_count, borrow, table.m_ends);
+	read_column(reader, MidiCacheSection_NoteIds, row_count, borrow, table.m_note_ids);
+	read_column(reader, MidiCacheSection_NoteVelocities, row_count, borrow, table.m_velocities);
+	read_column(reader, MidiCacheSection_NoteChannels, row_count, borrow, table.m_channels);
+	read_column(reader, MidiCacheSection_NoteTrackIds, row_count, borrow, table.m_track_ids);
+	read_column(reader, MidiCacheSection_NoteBarIds, row_count, borrow, table.m_bar_ids);
+	read_column(reader, MidiCacheSection_NoteTimeUnits, row_count, borrow, table.m_time_units);
+	read_column(reader, MidiCacheSection_NoteMaxEnds, row_count, borrow, table.m_max_ends);
+
+	const MidiCacheString *note_names = reader.Section<MidiCacheString>(MidiCacheSection_NoteNames);
+	const size_t name_count = reader.Count(MidiCacheSection_NoteNames);
+	read_column(reader, MidiCacheSection_NoteTrackNameIds, reader.Count(MidiCacheSection_NoteTrackNameIds), borrow, table.m_track_name_ids);
+	read_column(reader, MidiCacheSection_NoteNameOffsets, name_count + 1, borrow, table.m_name_offsets);
+	read_column(reader, MidiCacheSection_NoteNameRows, row_count, borrow, table.m_name_rows);
+
+	// Everything else is only read, but these pick out other rows and
+	// names, so a damaged file mustn't take them out of bounds
+	const MidiNoteColumn<unsigned int> &track_name_ids = table.m_track_name_ids;
+	const MidiNoteColumn<size_t> &name_offsets = table.m_name_offsets;
+	for (size_t row = 0; row < row_count; ++row)
+	{
+		const unsigned int track_id = table.m_track_ids[row];
+		if (track_id >= track_name_ids.size() || track_name_ids[track_id] >= name_count) throw MidiError(MidiError_BadCacheFile);
+		if (table.m_name_rows[row] >= row_count) throw MidiError(MidiError_BadCacheFile);
+	}
+
+	if (name_offsets[0] != 0 || name_offsets[name_count] != row_count) throw MidiError(MidiError_BadCacheFile);
+	for (size_t i = 0; i < name_count; ++i)
+	{
+		if (name_offsets[i + 1] < name_offsets[i]) throw MidiError(MidiError_BadCacheFile);
+	}
+
+	// Each name shares the MidiTrackName of the first track it belongs to.
+	// Tracks without notes have no name in the table (and the rows were
+	// checked above not to point at them).
+	vector<size_t> name_tracks(name_count, track_count);
+	for (size_t track_id = 0; track_id < track_name_ids.size() && track_id < track_count; ++track_id)
+	{
+		const unsigned int name = track_name_ids[track_id];
+		if (name < name_count && name_tracks[name] == track_count) name_tracks[name] = track_id;
+	}
+
+	table.m_track_names.resize(name_count);
+	for (size_t i = 0; i < name_count; ++i)
+	{
+		const size_t track_id = name_tracks[i];
+		if (track_id < track_count) table.m_track_names[i] = read_track_name(reader, note_names[i], tracks[track_id].name, m.m_tracks[track_id].m_track_name);
+		else table.m_track_names[i] = MidiTrackName(reader.String(note_names[i]));
+	}
+
+	// FindTrack finds a name's rows by its text, so no two can have the
+	// same one
+	vector<const MidiTrackName*> sorted_names(name_count);
+	for (size_t i = 0; i < name_count; ++i) sorted_names[i] = &table.m_track_names[i];
+
+	sort(sorted_names.begin(), sorted_names.end(), [](const MidiTrackName *lhs, const MidiTrackName *rhs) { return lhs->Text() < rhs->Text(); });
+	for (size_t i = 1; i < name_count; ++i)
+	{
+		if (sorted_names[i - 1]->Text() == sorted_names[i]->Text()) throw MidiError(MidiError_BadCacheFile);
+	}
+
+	m.FillNoteSet();
+
+	m.m_initialized = true;
+
+	return m;
+}
+
+Midi MidiCache::ReadFromFile(const string &filename)
+{
+	shared_ptr<MidiMappedFile> file(new MidiMappedFile(filename));
+	return Read(file->Data(), file->Size(), file);
+}
@@ -0,0 +1,65 @@
+#ifndef __MIDI_CACHE_H
+#define __MIDI_CACHE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstddef>
+
+#include "Midi.h"
+
+class MidiMappedFile;
+
+// Precompiled song cache (.midc files).
+//
+// A .midc holds a fully loaded Midi exactly as ReadFromFile leaves it:
+// every track's events with their pulses and microseconds, the meter
+// and tempo tracks, the tempo map, bar and beat tables, the note table
+// and the private info.  Loading one runs none of the derivation
+// (meter/tempo tracks, tempo map, bar times, event times, note
+// translation or the note table's indexes).
+//
+// The arrays are stored just as they are in memory.  The note table's
+// columns are used right out of the mapped file, which stays mapped for
+// as long as the song (or a copy of its table) is around.  Tempo edits
+// change the tempo map, bar, beat and event time arrays in place, so
+// each of those (and each track's own note list) is one block copy out
+// of the mapping.  Events hold a pointer to their shared payload, so
+// they can't be copied as a block, but each is a fixed record with
+// nothing to decode: its payload is an index in a table of the distinct
+// payloads, each of which is made only once.
+//
+// The layout is native to the machine that wrote it.  Every file starts
+// with a versioned header, and anything written by another version (or
+// with another byte order or record layout) is turned away with
+// MidiError_StaleCacheFile so the caller can rebuild it from the MIDI.
+// Damaged or truncated files throw MidiError_BadCacheFile.
+class MidiCache
+{
+public:
+	static Midi ReadFromFile(const std::string &filename);
+
+	// 'data' has to be 8-byte aligned (mapped files always are).  It's
+	// only needed during the call, so the note table is copied out of it
+	// too.
+	static Midi ReadFromMemory(const unsigned char *data, size_t length);
+
+	// Only fully loaded songs can be written (see Midi::IsFullyLoaded).
+	// Play/mute track selections and playback position aren't stored.
+	//
+	// The file is written under a temporary name and renamed into place,
+	// so readers only ever see a complete cache (or none at all).
+	static void WriteToFile(const Midi &midi, const std::string &filename);
+	static void WriteToMemory(const Midi &midi, std::vector<unsigned char> &out);
+
+	// Where the cache for a MIDI file with these bytes lives in
+	// 'directory'.  The name is a hash of the bytes plus the cache format
+	// version, so edited songs and library upgrades both miss.
+	static std::string CacheFilename(const std::string &directory, const unsigned char *data, size_t length);
+
+private:
+	// The note table borrows its columns from 'mapping' when it's set
+	static Midi Read(const unsigned char *data, size_t length, const std::shared_ptr<MidiMappedFile> &mapping);
+};
+
+#endif
@@ -1,46 +1,112 @@
 #include "MidiEvent.h"
 #include "MidiUtil.h"
+#include "MidiByteCursor.h"
 #include "Note.h"
 
+#include <vector>
+#include <new>
+
 using namespace std;
 
+// Copies one variable length number off the stream into 'bytes'
+// (still encoded) and returns its value.
+static unsigned long copy_variable_length(istream &stream, vector<unsigned char> &bytes)
+{
+	unsigned long value = 0;
+	int c;
+	do
+	{
+		c = stream.get();
+		if (c == char_traits<char>::eof()) throw MidiError(MidiError_EventTooShort);
+
+		bytes.push_back(static_cast<unsigned char>(c));
+		value = (value << 7) + (c & 0x7F);
+	} while (c & 0x80);
+
+	return value;
+}
+
 MidiEvent MidiEvent::ReadFromStream(istream &stream, unsigned char last_status)
+{
+	// Pull exactly one event's worth of bytes off the stream, then let
+	// the cursor decoder do the real work.  Only lengths are looked at
+	// here.
+	vector<unsigned char> bytes;
+	copy_variable_length(stream, bytes);
+
+	unsigned char status = static_cast<unsigned char>(stream.peek());
+	if ((status & 0x80) == 0) status = last_status;
+	else bytes.push_back(static_cast<unsigned char>(stream.get()));
+
+	unsigned long length;
+	switch (TypeFromStatus(status))
+	{
+	case MidiEventType_Meta:
+		bytes.push_back(static_cast<unsigned char>(stream.get()));
+		length = copy_variable_length(stream, bytes);
+		break;
+
+	case MidiEventType_SysEx:
+		length = copy_variable_length(stream, bytes);
+		break;
+
+	case MidiEventType_ProgramChange:
+	case MidiEventType_ChannelPressure:
+		length = 1;
+		break;
+
+	default:
+		length = 2;
+		break;
+	}
+
+	const size_t header_length = bytes.size();
+	bytes.resize(header_length + length);
+	if (length > 0) stream.read(reinterpret_cast<char*>(&bytes[header_length]), length);
+	if (stream.fail()) throw MidiError(MidiError_EventTooShort);
+
+	MidiByteCursor cursor(&bytes[0], bytes.size());
+	return ReadFromCursor(cursor, last_status);
+}
+
+MidiEvent MidiEvent::ReadFromCursor(MidiByteCursor &cursor, unsigned char last_status, const shared_ptr<MidiArena> &arena)
 {
 	MidiEvent ev;
 
-	ev.m_delta_pulses = parse_variable_length(stream);
+	ev.SetDeltaPulses(cursor.ReadVariableLength());
 
 	// MIDI uses a compression mechanism called "running status".
 	// Anytime you read a status byte that doesn't have the highest-
 	// order bit set, what you actually read is the 1st data byte
 	// of a message with the status of the previous message.
-	ev.m_status = static_cast<unsigned char>(stream.peek());
-	if ((ev.m_status & 0x80) == 0)
+	unsigned char status = cursor.PeekByte();
+	if ((status & 0x80) == 0)
 	{
-		ev.m_status = last_status;
+		status = last_status;
 	}
 	else
 	{
-		// It was a status byte after all, just read past it
-		// in the stream
-		stream.read(reinterpret_cast<char*>(&ev.m_status), sizeof(unsigned char));
+		// It was a status byte after all, just move past it
+		cursor.Skip(1);
 	}
+	ev.SetStatus(status);
 
 	switch (ev.Type())
 	{
-	case MidiEventType_Meta:  ev.ReadMeta(stream);      break;
-	case MidiEventType_SysEx: ev.ReadSysEx(stream);     break;
-	default:                  ev.ReadStandard(stream);  break;
+	case MidiEventType_Meta:  ev.ReadMeta(cursor, arena); break;
+	case MidiEventType_SysEx: ev.ReadSysEx(cursor);       break;
+	default:                  ev.ReadStandard(cursor);    break;
 	}
 
 	return ev;
 }
+
 MidiEvent MidiEvent::Build(const MidiEventSimple &simple)
 {
 	MidiEvent ev;
 
 	ev.m_delta_pulses = 0;
-	ev.m_status = simple.status;
+	ev.SetStatus(simple.status);
 	ev.m_data1 = simple.byte1;
 	ev.m_data2 = simple.byte2;
 	if (ev.Type() == MidiEventType_Meta) throw MidiError(MidiError_MetaEventOnInput);
@@ -51,29 +117,161 @@ MidiEvent MidiEvent::Build(const MidiEventSimple &simple)
 MidiEvent MidiEvent::NullEvent()
 {
 	MidiEvent ev;
-	ev.m_status = 0xFF;
-	ev.m_meta_type = MidiMetaEvent_Proprietary;
+	ev.SetStatus(0xFF);
+	ev.MutablePayload().meta_type = MidiMetaEvent_Proprietary;
 	ev.m_delta_pulses = 0;
 
 	return ev;
 }
 
-void MidiEvent::ReadMeta(std::istream &stream)
+MidiEvent MidiEvent::TempoChange(unsigned long us_per_quarter_note)
+{
+	MidiEvent ev;
+	ev.SetStatus(0xFF);
+	ev.MutablePayload().meta_type = MidiMetaEvent_TempoChange;
+	ev.MutablePayload().tempo_uspqn = us_per_quarter_note;
+	ev.m_delta_pulses = 0;
+
+	return ev;
+}
+
+MidiEvent::MidiEvent(const MidiEvent &other) : m_status(other.m_status), m_data1(other.m_data1), m_data2(other.m_data2),
+	m_type(other.m_type), m_delta_pulses(other.m_delta_pulses), m_payload(other.m_payload)
+{
+	if (m_payload) m_payload->references.fetch_add(1, memory_order_relaxed);
+}
+
+MidiEvent::MidiEvent(MidiEvent &&other) noexcept : m_status(other.m_status), m_data1(other.m_data1), m_data2(other.m_data2),
+	m_type(other.m_type), m_delta_pulses(other.m_delta_pulses), m_payload(other.m_payload)
+{
+	other.m_payload = NULL;
+}
+
+MidiEvent &MidiEvent::operator=(const MidiEvent &other)
+{
+	if (other.m_payload) other.m_payload->references.fetch_add(1, memory_order_relaxed);
+	Release();
+
+	m_status = other.m_status;
+	m_data1 = other.m_data1;
+	m_data2 = other.m_data2;
+	m_type = other.m_type;
+	m_delta_pulses = other.m_delta_pulses;
+	m_payload = other.m_payload;
+
+	return *this;
+}
+
+MidiEvent &MidiEvent::operator=(MidiEvent &&other) noexcept
+{
+	if (this == &other) return *this;
+	Release();
+
+	m_status = other.m_status;
+	m_data1 = other.m_data1;
+	m_data2 = other.m_data2;
+	m_type = other.m_type;
+	m_delta_pulses = other.m_delta_pulses;
+	m_payload = other.m_payload;
+	other.m_payload = NULL;
+
+	return *this;
+}
+
+void MidiEvent::Release()
+{
+	if (m_payload && m_payload->references.fetch_sub(1, memory_order_acq_rel) == 1)
+	{
+		if (!m_payload->arena) delete m_payload;
+		else
+		{
+			// The memory stays in the arena; just make sure the arena
+			// outlives the destructor
+			shared_ptr<MidiArena> arena;
+			arena.swap(m_payload->arena);
+			m_payload->~MidiEventPayload();
+		}
+	}
+
+	m_payload = NULL;
+}
+
+MidiEventPayload *MidiEvent::NewPayload(const shared_ptr<MidiArena> &arena)
 {
-	stream.read(reinterpret_cast<char*>(&m_meta_type), sizeof(unsigned char));
-	unsigned long meta_length = parse_variable_length(stream);
+	if (!arena) return new MidiEventPayload();
+	return new (arena->Allocate(sizeof(MidiEventPayload))) MidiEventPayload(arena);
+}
 
-	char *buffer = new char[meta_length + 1];
-	buffer[meta_length] = 0;
+MidiEventPayload &MidiEvent::MutablePayload()
+{
+	if (!m_payload)
+	{
+		m_payload = new MidiEventPayload();
+	}
+	else if (m_payload->references.load(memory_order_acquire) > 1)
+	{
+		MidiEventPayload *copy = new MidiEventPayload(*m_payload);
+		Release();
+		m_payload = copy;
+	}
+
+	return *m_payload;
+}
 
-	stream.read(buffer, meta_length);
-	if (stream.fail())
+MidiEventPayload &MidiEvent::HeapPayload()
+{
+	if (m_payload && m_payload->arena)
 	{
-		delete[] buffer;
-		throw MidiError(MidiError_EventTooShort);
+		MidiEventPayload *copy = new MidiEventPayload(*m_payload);
+		Release();
+		m_payload = copy;
 	}
 
-	switch (m_meta_type)
+	return MutablePayload();
+}
+
+void MidiEvent::setTrackName(std::string name)
+{
+	if (getTrackName() == name) return;
+	MutablePayload().track_name = MidiTrackName(name);
+}
+
+void MidiEvent::setTrackName(const MidiTrackName &name)
+{
+	MutablePayload().track_name = name;
+}
+
+void MidiEvent::ShareTrackName(const MidiEvent &named)
+{
+	if (m_payload == named.m_payload) return;
+
+	if ((!m_payload || m_payload->NameOnly()) && named.m_payload && named.m_payload->NameOnly())
+	{
+		named.m_payload->references.fetch_add(1, memory_order_relaxed);
+		Release();
+		m_payload = named.m_payload;
+		return;
+	}
+
+	if (named.m_payload) setTrackName(named.m_payload->track_name);
+	else setTrackName(std::string());
+}
+
+void MidiEvent::ReadMeta(MidiByteCursor &cursor, const shared_ptr<MidiArena> &arena)
+{
+	Release();
+	m_payload = NewPayload(arena);
+
+	MidiEventPayload &payload = *m_payload;
+
+	payload.meta_type = cursor.ReadByte();
+	unsigned long meta_length = cursor.ReadVariableLength();
+
+	// Points into the cursor's range.  Nothing is copied unless we
+	// decide to keep it below.
+	const unsigned char *buffer = cursor.ReadBytes(meta_length);
+
+	switch (payload.meta_type)
 	{
 	case MidiMetaEvent_Text:
 	case MidiMetaEvent_Copyright:
@@ -84,20 +282,17 @@ void MidiEvent::ReadMeta(std::istream &stream)
 	case MidiMetaEvent_Cue:
 	case MidiMetaEvent_PatchName:
 	case MidiMetaEvent_DeviceName:
-		m_text = string(buffer, meta_length);
+		payload.text.assign(reinterpret_cast<const char*>(buffer), meta_length);
 		break;
 
 	case MidiMetaEvent_TempoChange:
 		{
 			if (meta_length < 3) throw MidiError(MidiError_EventTooShort);
 
-			// We have to convert to unsigned char first for some reason or the
-			// conversion gets all wacky and tries to look at more than just its
-			// one byte at a time.
-			unsigned int b0 = static_cast<unsigned char>(buffer[0]);
-			unsigned int b1 = static_cast<unsigned char>(buffer[1]);
-			unsigned int b2 = static_cast<unsigned char>(buffer[2]);
-			m_tempo_uspqn = (b0 << 16) + (b1 << 8) + b2;
+			unsigned int b0 = buffer[0];
+			unsigned int b1 = buffer[1];
+			unsigned int b2 = buffer[2];
+			payload.tempo_uspqn = (b0 << 16) + (b1 << 8) + b2;
 		}
 		break;
 
@@ -111,35 +306,25 @@ void MidiEvent::ReadMeta(std::istream &stream)
 	case MidiMetaEvent_MidiPort:
 		// NOTE: We would have to keep all of this around if we
 		// wanted to reproduce 1:1 MIDIs between file Save/Load
-		for (int i=0; i<meta_length; ++i)
-		{
-			m_other_data.push_back(buffer[i]);
-		}
+		payload.other_data.assign(buffer, buffer + meta_length);
 		break;
 
 	default:
-		{
-			delete[] buffer;
-			throw MidiError(MidiError_UnknownMetaEventType);
-		}
+		throw MidiError(MidiError_UnknownMetaEventType);
 	}
-
-	delete[] buffer;
 }
 
-void MidiEvent::ReadSysEx(std::istream &stream)
+void MidiEvent::ReadSysEx(MidiByteCursor &cursor)
 {
 	// NOTE: We would have to keep SysEx events around if we
 	// wanted to reproduce 1:1 MIDIs between file Save/Load
-	unsigned long sys_ex_length = parse_variable_length(stream);
+	unsigned long sys_ex_length = cursor.ReadVariableLength();
 
 	// Discard
-	char *buffer = new char[sys_ex_length];
-	stream.read(buffer, sys_ex_length);
-	delete[] buffer;
+	cursor.Skip(sys_ex_length);
 }
 
-void MidiEvent::ReadStandard(std::istream &stream)
+void MidiEvent::ReadStandard(MidiByteCursor &cursor)
 {
 	switch (Type())
 	{
@@ -149,15 +334,16 @@ void MidiEvent::ReadStandard(std::istream &stream)
 	case MidiEventType_Controller:
 	case MidiEventType_PitchWheel:
 		{
-			stream.read(reinterpret_cast<char*>(&m_data1), sizeof(unsigned char));
-			stream.read(reinterpret_cast<char*>(&m_data2), sizeof(unsigned char));
+			const unsigned char *data = cursor.ReadBytes(2);
+			m_data1 = data[0];
+			m_data2 = data[1];
 		}
 		break;
 
 	case MidiEventType_ProgramChange:
 	case MidiEventType_ChannelPressure:
 		{
-			stream.read(reinterpret_cast<char*>(&m_data1), sizeof(unsigned char));
+			m_data1 = cursor.ReadByte();
 			m_data2 = 0;
 		}
 		break;
@@ -179,15 +365,15 @@ bool MidiEvent::GetSimpleEvent(MidiEventSimple *simple) const
 	return true;
 }
 
-MidiEventType MidiEvent::Type() const
+MidiEventType MidiEvent::TypeFromStatus(unsigned char status)
 {
-	if (m_status >  0xEF && m_status < 0xFF) return MidiEventType_SysEx;
-	if (m_status <  0x80) return MidiEventType_Unknown;
-	if (m_status == 0xFF) return MidiEventType_Meta;
+	if (status >  0xEF && status < 0xFF) return MidiEventType_SysEx;
+	if (status <  0x80) return MidiEventType_Unknown;
+	if (status == 0xFF) return MidiEventType_Meta;
 
 	// The 0x8_ through 0xE_ events contain channel numbers
 	// in the lowest 4 bits
-	unsigned char status_top = m_status >> 4;
+	unsigned char status_top = status >> 4;
 
 	switch (status_top)
 	{
@@ -205,9 +391,9 @@ MidiEventType MidiEvent::Type() const
 
 MidiMetaEventType MidiEvent::MetaType() const
 {
-	if (Type() != MidiEventType_Meta) return MidiMetaEvent_Unknown;
+	if (Type() != MidiEventType_Meta || !m_payload) return MidiMetaEvent_Unknown;
 
-	return static_cast<MidiMetaEventType>(m_meta_type);
+	return static_cast<MidiMetaEventType>(m_payload->meta_type);
 }
 
 bool MidiEvent::IsEnd() const
@@ -225,11 +411,8 @@ void MidiEvent::SetChannel(unsigned char channel)
 {
 	if (channel > 15) return;
 
-	// Clear out the old channel
-	m_status = m_status & 0xF0;
-
-	// Set the new channel
-	m_status = m_status | channel;
+	// Clear out the old channel, then set the new one
+	SetStatus((m_status & 0xF0) | channel);
 }
 
 void MidiEvent::SetVelocity(int velocity)
@@ -241,9 +424,7 @@ void MidiEvent::SetVelocity(int velocity)
 
 bool MidiEvent::HasText() const
 {
-	if (Type() != MidiEventType_Meta) return false;
-
-	switch (m_meta_type)
+	switch (MetaType())
 	{
 	case MidiMetaEvent_Text:
 	case MidiMetaEvent_Copyright:
@@ -300,7 +481,7 @@ int MidiEvent::NoteVelocity() const
 std::string MidiEvent::Text() const
 {
 	if (!HasText()) return "";
-	return m_text;
+	return string(m_payload->text.begin(), m_payload->text.end());
 }
 
 unsigned long MidiEvent::GetTempoInUsPerQn() const
@@ -310,30 +491,41 @@ unsigned long MidiEvent::GetTempoInUsPerQn() const
 		throw MidiError(MidiError_RequestedTempoFromNonTempoEvent);
 	}
 
-	return m_tempo_uspqn;
+	return m_payload->tempo_uspqn;
 }
 
 
 unsigned int MidiEvent::BeatMember() const
 {
-	if (Type() != MidiEventType_Meta &&  MetaType() == MidiMetaEvent_TimeSignature) return 0;
-	return m_other_data[0];
+	const MidiEventData *other_data = TimeSignatureData();
+	if (!other_data) return 0;
+
+	return (*other_data)[0];
 }
 
 
 unsigned int MidiEvent::BeatDenominator() const
 {
-	int beat_denominator = 0;
-	if (Type() != MidiEventType_Meta &&  MetaType() == MidiMetaEvent_TimeSignature) return 0;
+	const MidiEventData *other_data = TimeSignatureData();
+	if (!other_data) return 0;
 
-	if (m_other_data[1] == 0x00)
+	int beat_denominator = 0;
+	if ((*other_data)[1] == 0x00)
 		beat_denominator = 1;
-	else if (m_other_data[1] == 0x01)
+	else if ((*other_data)[1] == 0x01)
 		beat_denominator = 2;
-	else if (m_other_data[1] == 0x02)
+	else if ((*other_data)[1] == 0x02)
 		beat_denominator = 4;
-	else if (m_other_data[1] == 0x03)
+	else if ((*other_data)[1] == 0x03)
 		beat_denominator = 8;
 
 	return beat_denominator;
-}
\ No newline at end of file
+}
+
+const MidiEventData *MidiEvent::TimeSignatureData() const
+{
+	if (!m_payload || Type() != MidiEventType_Meta || MetaType() != MidiMetaEvent_TimeSignature) return NULL;
+	if (m_payload->other_data.size() < 2) return NULL;
+
+	return &m_payload->other_data;
+}
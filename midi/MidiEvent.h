@@ -2,11 +2,17 @@
 #define __MIDI_EVENT_H
 
 #include <string>
+#include <vector>
 #include <iostream>
+#include <atomic>
+#include <memory>
 
 #include "MidiUtil.h"
+#include "MidiArena.h"
 #include "Note.h"
 
+class MidiByteCursor;
+
 
 struct MidiEventSimple
 {
@@ -21,27 +27,98 @@ struct MidiEventSimple
 
 using namespace std;
 
+// Text and data bytes of an event.  Events read from a file keep them in
+// their track's arena (see MidiArenaBumpAllocator); anything copied or
+// changed afterwards is on the heap.
+typedef std::basic_string<char, std::char_traits<char>, MidiArenaBumpAllocator<char> > MidiEventText;
+typedef std::vector<unsigned char, MidiArenaBumpAllocator<unsigned char> > MidiEventData;
+
+// Everything a plain channel message doesn't need: meta data, text and
+// the name of the track it came from.  Copies of an event share one of
+// these, and every channel message in a track shares the same
+// name-only one (see MidiEvent::ShareTrackName).  It's copied only when
+// one of the sharers changes it.  The name itself is the track's own
+// MidiTrackName, which renaming the track replaces (see
+// MidiTrack::SetTrackName).
+//
+// Payloads read from a file live in the track's arena along with their
+// text, and 'arena' keeps it alive for as long as they do.  Copies are
+// always made on the heap.
+struct MidiEventPayload
+{
+	MidiEventPayload() : references(1), meta_type(MidiMetaEvent_Unknown), tempo_uspqn(0) { }
+	explicit MidiEventPayload(const std::shared_ptr<MidiArena> &payload_arena) : references(1), meta_type(MidiMetaEvent_Unknown), tempo_uspqn(0),
+		text(MidiArenaBumpAllocator<char>(payload_arena)), other_data(MidiArenaBumpAllocator<unsigned char>(payload_arena)), arena(payload_arena) { }
+	MidiEventPayload(const MidiEventPayload &other) : references(1), meta_type(other.meta_type), tempo_uspqn(other.tempo_uspqn),
+		text(other.text), other_data(other.other_data), track_name(other.track_name) { }
+
+	// True when all this carries is a track name
+	bool NameOnly() const { return meta_type == MidiMetaEvent_Unknown && tempo_uspqn == 0 && text.empty() && other_data.empty(); }
+
+	std::atomic<unsigned int> references;
+
+	unsigned char meta_type;
+	unsigned long tempo_uspqn;
+	MidiEventText text;
+	MidiEventData other_data;
+
+	MidiTrackName track_name;
+
+	// Where this payload itself was allocated, if not on the heap
+	std::shared_ptr<MidiArena> arena;
+
+private:
+	MidiEventPayload &operator=(const MidiEventPayload &);
+};
+
+// 16 bytes on 64-bit builds: the three bytes of a channel message, its
+// type, the delta-time and a (usually shared) pointer to the rest.
 class MidiEvent
 {
 public:
+	// Decodes the event at the cursor (delta-time, running status,
+	// meta, SysEx and standard events) and moves the cursor past it.
+	// This is the decoder the track loader uses; it never touches an
+	// istream.
+	//
+	// With an 'arena', any text or data the event has goes in there (see
+	// MidiEventPayload).
+	static MidiEvent ReadFromCursor(MidiByteCursor &cursor, unsigned char last_status,
+		const std::shared_ptr<MidiArena> &arena = std::shared_ptr<MidiArena>());
+
+	// Convenience wrapper: reads one event's bytes off the stream and
+	// decodes them with ReadFromCursor.
 	static MidiEvent ReadFromStream(std::istream &stream, unsigned char last_status);
 	static MidiEvent Build(const MidiEventSimple &simple);
 	static MidiEvent NullEvent();
 
+	// A tempo change meta event, delta-time 0
+	static MidiEvent TempoChange(unsigned long us_per_quarter_note);
+
 	// NOTE: There is a VERY good chance you don't want to use this directly.
 	// The only reason it's not private is because the standard containers
 	// require a default constructor.
-	MidiEvent() : m_status(0), m_data1(0), m_data2(0), m_tempo_uspqn(0) { }
+	MidiEvent() : m_status(0), m_data1(0), m_data2(0), m_type(MidiEventType_Unknown), m_delta_pulses(0), m_payload(NULL) { }
+
+	// Copies share the payload (one atomic increment); moves take it
+	// without touching the count, and can't throw, so vectors of events
+	// grow by moving
+	MidiEvent(const MidiEvent &other);
+	MidiEvent(MidiEvent &&other) noexcept;
+	~MidiEvent() { Release(); }
+
+	MidiEvent &operator=(const MidiEvent &other);
+	MidiEvent &operator=(MidiEvent &&other) noexcept;
 
 	// Returns true if the event could be expressed in a simple event.  (So, this will
 	// return false for Meta and SysEx events.)
 	bool GetSimpleEvent(MidiEventSimple *simple) const;
 
-	MidiEventType Type() const;
+	MidiEventType Type() const { return static_cast<MidiEventType>(m_type); }
 	unsigned long GetDeltaPulses() const { return m_delta_pulses; }
 
 	// This is generally for internal Midi library use only.
-	void SetDeltaPulses(unsigned long delta_pulses) { m_delta_pulses = delta_pulses; }
+	void SetDeltaPulses(unsigned long delta_pulses) { m_delta_pulses = static_cast<unsigned int>(delta_pulses); }
 
 	NoteId NoteNumber() const;
 
@@ -94,10 +171,19 @@ public:
 	unsigned char GetEventData1() const { return m_data1; }		// �Զ���
 	unsigned char GetEventData2() const { return m_data2; }		// �Զ���
 
-	vector<unsigned char> &OtharData(void) { return m_other_data; }
+	// Moves the payload out of the arena first, since the data may grow
+	MidiEventData &OtharData(void) { return HeapPayload().other_data; }
+
+	void setTrackName(std::string name);
+	std::string getTrackName(void) const { return m_payload ? m_payload->track_name.Text() : std::string(); }
 
-	void setTrackName(std::string name) { m_strTrackName = name; }
-	std::string getTrackName(void) const { return m_strTrackName; }
+	// Makes the event share 'name' (see MidiTrackName)
+	void setTrackName(const MidiTrackName &name);
+
+	// Same as setTrackName(named.getTrackName()), except that channel
+	// messages end up pointing at named's payload instead of carrying a
+	// copy of the name each.
+	void ShareTrackName(const MidiEvent &named);
 
 	bool operator()(const MidiEvent &lhs, const MidiEvent &rhs)
 	{
@@ -114,23 +200,43 @@ public:
 	}
 
 private:
-	void ReadMeta(std::istream &stream);
-	void ReadSysEx(std::istream &stream);
-	void ReadStandard(std::istream &stream);
+	friend class MidiCache;
+
+	static MidiEventType TypeFromStatus(unsigned char status);
+	void SetStatus(unsigned char status) { m_status = status; m_type = static_cast<unsigned char>(TypeFromStatus(status)); }
+
+	// Makes sure we have a payload nobody else is looking at
+	MidiEventPayload &MutablePayload();
+
+	// The same, and on the heap: anything that can allocate text or data
+	// has to use this once the track is read, since the arena belongs to
+	// the thread that read it
+	MidiEventPayload &HeapPayload();
+
+	// The numerator and denominator bytes of a time signature, or NULL
+	// if this isn't one (or is cut short)
+	const MidiEventData *TimeSignatureData() const;
+
+	// An empty payload, in 'arena' if there is one
+	static MidiEventPayload *NewPayload(const std::shared_ptr<MidiArena> &arena);
+	void Release();
+
+	void ReadMeta(MidiByteCursor &cursor, const std::shared_ptr<MidiArena> &arena);
+	void ReadSysEx(MidiByteCursor &cursor);
+	void ReadStandard(MidiByteCursor &cursor);
 
 	unsigned char m_status;
 	unsigned char m_data1;
 	unsigned char m_data2;
-	unsigned long m_delta_pulses;
-
-	vector<unsigned char> m_other_data;
 
-	unsigned char m_meta_type;
+	// MidiEventType, worked out once from m_status
+	unsigned char m_type;
 
-	unsigned long m_tempo_uspqn;
-	std::string m_text;
+	// Delta-times are at most 28 bits in a MIDI file
+	unsigned int m_delta_pulses;
 
-	std::string m_strTrackName;
+	// NULL for channel messages from unnamed tracks
+	MidiEventPayload *m_payload;
 };
 
 #endif __MIDI_EVENT_H
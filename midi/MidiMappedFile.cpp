@@ -0,0 +1,99 @@
+#include "MidiMappedFile.h"
+#include "MidiUtil.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#ifdef _WIN32
+
+MidiMappedFile::MidiMappedFile(const std::string &filename) : m_data(NULL), m_size(0), m_file(NULL), m_mapping(NULL)
+{
+	HANDLE file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) throw MidiError(MidiError_BadFilename);
+
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file, &size))
+	{
+		CloseHandle(file);
+		throw MidiError(MidiError_BadFilename);
+	}
+
+	m_file = file;
+	m_size = static_cast<size_t>(size.QuadPart);
+
+	// Windows refuses to map an empty file.  Leave it unmapped and let
+	// the header check report the file as too short.
+	if (m_size == 0) return;
+
+	HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (mapping == NULL)
+	{
+		CloseHandle(file);
+		throw MidiError(MidiError_BadFilename);
+	}
+
+	m_mapping = mapping;
+	m_data = static_cast<const unsigned char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+	if (m_data == NULL)
+	{
+		CloseHandle(mapping);
+		CloseHandle(file);
+		throw MidiError(MidiError_BadFilename);
+	}
+}
+
+MidiMappedFile::~MidiMappedFile()
+{
+	if (m_data != NULL) UnmapViewOfFile(m_data);
+	if (m_mapping != NULL) CloseHandle(m_mapping);
+	if (m_file != NULL) CloseHandle(m_file);
+}
+
+#else
+
+MidiMappedFile::MidiMappedFile(const std::string &filename) : m_data(NULL), m_size(0)
+{
+	int file = open(filename.c_str(), O_RDONLY);
+	if (file < 0) throw MidiError(MidiError_BadFilename);
+
+	struct stat info;
+	if (fstat(file, &info) != 0 || !S_ISREG(info.st_mode))
+	{
+		close(file);
+		throw MidiError(MidiError_BadFilename);
+	}
+
+	m_size = static_cast<size_t>(info.st_size);
+
+	// mmap refuses zero-length mappings.  Leave it unmapped and let
+	// the header check report the file as too short.
+	if (m_size > 0)
+	{
+		void *data = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, file, 0);
+		if (data == MAP_FAILED)
+		{
+			close(file);
+			throw MidiError(MidiError_BadFilename);
+		}
+
+		// We walk the file front to back exactly once
+		madvise(data, m_size, MADV_SEQUENTIAL);
+		m_data = static_cast<const unsigned char*>(data);
+	}
+
+	// The mapping stays valid after the descriptor is gone
+	close(file);
+}
+
+MidiMappedFile::~MidiMappedFile()
+{
+	if (m_data != NULL) munmap(const_cast<unsigned char*>(m_data), m_size);
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef __MIDI_MAPPED_FILE_H
+#define __MIDI_MAPPED_FILE_H
+
+#include <string>
+#include <cstddef>
+
+// A read-only view of an entire file on disk.  The bytes are mapped
+// straight into our address space so the loader can decode tracks in
+// place without pulling them through an fstream first.
+//
+// Throws MidiError(MidiError_BadFilename) if the file can't be opened.
+class MidiMappedFile
+{
+public:
+	explicit MidiMappedFile(const std::string &filename);
+	~MidiMappedFile();
+
+	const unsigned char *Data() const { return m_data; }
+	size_t Size() const { return m_size; }
+
+private:
+	// A mapping owns an OS resource; copying it makes no sense.
+	MidiMappedFile(const MidiMappedFile &);
+	MidiMappedFile &operator=(const MidiMappedFile &);
+
+	const unsigned char *m_data;
+	size_t m_size;
+
+#ifdef _WIN32
+	void *m_file;
+	void *m_mapping;
+#endif
+};
+
+#endif
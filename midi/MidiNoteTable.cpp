@@ -0,0 +1,359 @@
+#include "MidiNoteTable.h"
+
+#include <algorithm>
+#include <climits>
+
+using namespace std;
+
+// The root of the subtree holding rows [first, last)
+static size_t subtree_root(size_t first, size_t last)
+{
+	return first + (last - first) / 2;
+}
+
+// Fills 'max_ends' (see MidiNoteTable::m_max_ends) for rows [first, last)
+// and returns their latest end
+static microseconds_t build_max_ends(const microseconds_t *ends, microseconds_t *max_ends, size_t first, size_t last)
+{
+	if (first >= last) return LLONG_MIN;
+
+	const size_t root = subtree_root(first, last);
+
+	microseconds_t max_end = ends[root];
+	max_end = max(max_end, build_max_ends(ends, max_ends, first, root));
+	max_end = max(max_end, build_max_ends(ends, max_ends, root + 1, last));
+
+	max_ends[root] = max_end;
+	return max_end;
+}
+
+// Equal as far as the note ordering goes
+static bool same_note(const TranslatedNote &lhs, const TranslatedNote &rhs)
+{
+	TranslatedNote less;
+	return !less(lhs, rhs) && !less(rhs, lhs);
+}
+
+MidiNoteTable::MidiNoteTable(const vector<TranslatedNote> &notes)
+{
+	Append(notes.begin(), notes.end(), notes.size());
+	BuildMaxEnds();
+	BuildNameIndex();
+}
+
+MidiNoteTable::MidiNoteTable(const TranslatedNoteSet &notes)
+{
+	Append(notes.begin(), notes.end(), notes.size());
+	BuildMaxEnds();
+	BuildNameIndex();
+}
+
+template <class NoteIterator>
+void MidiNoteTable::Append(NoteIterator first, NoteIterator last, size_t count)
+{
+	size_t row = Size();
+	const size_t size = row + count;
+
+	m_starts.Resize(size);
+	m_ends.Resize(size);
+	m_note_ids.Resize(size);
+	m_velocities.Resize(size);
+	m_channels.Resize(size);
+	m_track_ids.Resize(size);
+	m_bar_ids.Resize(size);
+	m_time_units.Resize(size);
+
+	microseconds_t *starts = m_starts.MutableData();
+	microseconds_t *ends = m_ends.MutableData();
+	NoteId *note_ids = m_note_ids.MutableData();
+	unsigned char *velocities = m_velocities.MutableData();
+	unsigned char *channels = m_channels.MutableData();
+	unsigned int *track_ids = m_track_ids.MutableData();
+	unsigned int *bar_ids = m_bar_ids.MutableData();
+	microseconds_t *time_units = m_time_units.MutableData();
+
+	// Which name each track has.  A track's notes all carry the same
+	// name, so names are only compared once per track, and each distinct
+	// name is only kept once.
+	const unsigned int NoName = static_cast<unsigned int>(-1);
+	vector<unsigned int> track_name_ids(m_track_name_ids.begin(), m_track_name_ids.end());
+
+	for (NoteIterator i = first; i != last; ++i, ++row)
+	{
+		if (i->track_id >= track_name_ids.size()) track_name_ids.resize(i->track_id + 1, NoName);
+
+		unsigned int &name = track_name_ids[i->track_id];
+		if (name == NoName)
+		{
+			name = static_cast<unsigned int>(find(m_track_names.begin(), m_track_names.end(), i->track_name) - m_track_names.begin());
+			if (name == m_track_names.size()) m_track_names.push_back(MidiTrackName(i->track_name));
+		}
+
+		starts[row] = i->start;
+		ends[row] = i->end;
+		note_ids[row] = i->note_id;
+		velocities[row] = static_cast<unsigned char>(i->velocity);
+		channels[row] = i->channel;
+		track_ids[row] = static_cast<unsigned int>(i->track_id);
+		bar_ids[row] = i->bar_id;
+		time_units[row] = i->time_unit;
+	}
+
+	m_track_name_ids.Own(track_name_ids);
+}
+
+void MidiNoteTable::Truncate(size_t count)
+{
+	m_starts.Resize(count);
+	m_ends.Resize(count);
+	m_note_ids.Resize(count);
+	m_velocities.Resize(count);
+	m_channels.Resize(count);
+	m_track_ids.Resize(count);
+	m_bar_ids.Resize(count);
+	m_time_units.Resize(count);
+}
+
+void MidiNoteTable::BuildMaxEnds()
+{
+	vector<microseconds_t> max_ends(Size());
+	if (!max_ends.empty()) build_max_ends(m_ends.data(), &max_ends[0], 0, max_ends.size());
+
+	m_max_ends.Own(max_ends);
+}
+
+void MidiNoteTable::BuildNameIndex()
+{
+	const size_t count = Size();
+
+	// Group the rows by name, keeping them in order within each name
+	vector<size_t> name_offsets(m_track_names.size() + 1, 0);
+	for (size_t row = 0; row < count; ++row) ++name_offsets[m_track_name_ids[m_track_ids[row]] + 1];
+	for (size_t name = 0; name < m_track_names.size(); ++name) name_offsets[name + 1] += name_offsets[name];
+
+	vector<size_t> next(name_offsets.begin(), name_offsets.end() - 1);
+	vector<unsigned int> name_rows(count);
+	for (size_t row = 0; row < count; ++row) name_rows[next[m_track_name_ids[m_track_ids[row]]]++] = static_cast<unsigned int>(row);
+
+	m_name_offsets.Own(name_offsets);
+	m_name_rows.Own(name_rows);
+}
+
+void MidiNoteTable::Merge(const vector<TranslatedNote> &notes)
+{
+	if (notes.empty()) return;
+
+	// Everything before the first new note stays where it is
+	const size_t first = FirstRowNotBefore(notes.front());
+
+	vector<TranslatedNote> merged;
+	merged.reserve(Size() - first + notes.size());
+	for (size_t row = first; row < Size(); ++row) merged.push_back(Note(row));
+
+	// The rows go first, so of two alike the row is the one kept
+	const size_t moved = merged.size();
+	merged.insert(merged.end(), notes.begin(), notes.end());
+	inplace_merge(merged.begin(), merged.begin() + moved, merged.end(), TranslatedNote());
+	merged.erase(unique(merged.begin(), merged.end(), same_note), merged.end());
+
+	Truncate(first);
+	Append(merged.begin(), merged.end(), merged.size());
+
+	BuildMaxEnds();
+	BuildNameIndex();
+}
+
+bool MidiNoteTable::RowBefore(size_t row, const TranslatedNote &note) const
+{
+	if (m_starts[row] != note.start) return m_starts[row] < note.start;
+	if (m_ends[row] != note.end) return m_ends[row] < note.end;
+	if (m_note_ids[row] != note.note_id) return m_note_ids[row] < note.note_id;
+	if (m_channels[row] != note.channel) return m_channels[row] < note.channel;
+	return m_track_ids[row] < note.track_id;
+}
+
+size_t MidiNoteTable::FirstRowNotBefore(const TranslatedNote &note, size_t from) const
+{
+	// Rows before 'first' are before 'note', and 'last' (if there is one)
+	// isn't.  Steps twice as long each time find a 'last' near 'from'
+	// without looking at the whole table.
+	size_t first = from;
+	size_t last = from;
+	for (size_t step = 1; last < Size() && RowBefore(last, note); step *= 2)
+	{
+		first = last + 1;
+		last = first + step;
+	}
+
+	if (last > Size()) last = Size();
+
+	while (first < last)
+	{
+		const size_t middle = first + (last - first) / 2;
+		if (RowBefore(middle, note)) first = middle + 1;
+		else last = middle;
+	}
+
+	return first;
+}
+
+size_t MidiNoteTable::FindRow(const TranslatedNote &note) const
+{
+	return FindRow(note, 0);
+}
+
+size_t MidiNoteTable::FindRow(const TranslatedNote &note, size_t hint) const
+{
+	const size_t first = FirstRowNotBefore(note, hint);
+	if (first == Size()) return Size();
+
+	// Nothing before 'note' is left, so this is it unless it comes after
+	const bool after = m_starts[first] != note.start || m_ends[first] != note.end || m_note_ids[first] != note.note_id
+		|| m_channels[first] != note.channel || m_track_ids[first] != note.track_id;
+	return after ? Size() : first;
+}
+
+bool MidiNoteTable::RowsInOrder(size_t row, microseconds_t previous_start, microseconds_t previous_end,
+	microseconds_t start, microseconds_t end) const
+{
+	if (previous_start != start) return previous_start < start;
+	if (previous_end != end) return previous_end < end;
+	if (m_note_ids[row - 1] != m_note_ids[row]) return m_note_ids[row - 1] < m_note_ids[row];
+	if (m_channels[row - 1] != m_channels[row]) return m_channels[row - 1] < m_channels[row];
+	return m_track_ids[row - 1] < m_track_ids[row];
+}
+
+bool MidiNoteTable::Retime(const vector<MidiNoteRetime> &rows, size_t shift_row, microseconds_t delta)
+{
+	const size_t count = Size();
+	if (shift_row > count) shift_row = count;
+
+	// Nothing before the first row that moves changes
+	const size_t first = rows.empty() ? shift_row : min(rows.front().row, shift_row);
+	if (first == count) return true;
+
+	// See that the new times keep the order before writing any of them
+	vector<MidiNoteRetime>::const_iterator next = rows.begin();
+	microseconds_t previous_start = (first == 0) ? 0 : m_starts[first - 1];
+	microseconds_t previous_end = (first == 0) ? 0 : m_ends[first - 1];
+	for (size_t row = first; row < count; ++row)
+	{
+		microseconds_t start = m_starts[row];
+		microseconds_t end = m_ends[row];
+		if (next != rows.end() && next->row == row)
+		{
+			start = next->start;
+			end = next->end;
+			++next;
+		}
+		else if (row >= shift_row)
+		{
+			start += delta;
+			end += delta;
+		}
+
+		if (row > 0 && !RowsInOrder(row, previous_start, previous_end, start, end)) return false;
+
+		previous_start = start;
+		previous_end = end;
+	}
+
+	microseconds_t *starts = m_starts.MutableData();
+	microseconds_t *ends = m_ends.MutableData();
+	microseconds_t *time_units = m_time_units.MutableData();
+	unsigned int *bar_ids = m_bar_ids.MutableData();
+
+	for (next = rows.begin(); next != rows.end(); ++next)
+	{
+		starts[next->row] = next->start;
+		ends[next->row] = next->end;
+		time_units[next->row] = next->time_unit;
+		bar_ids[next->row] = next->bar_id;
+	}
+
+	// Past the shift the tempo and bars are the same as before, just later
+	for (size_t row = shift_row; row < count; ++row)
+	{
+		starts[row] += delta;
+		ends[row] += delta;
+	}
+
+	BuildMaxEnds();
+	return true;
+}
+
+size_t MidiNoteTable::LowerBound(microseconds_t start) const
+{
+	return lower_bound(m_starts.begin(), m_starts.end(), start) - m_starts.begin();
+}
+
+MidiNoteView MidiNoteTable::FindTrack(const std::string &track_name) const
+{
+	for (size_t name = 0; name < m_track_names.size(); ++name)
+	{
+		if (m_track_names[name] != track_name) continue;
+
+		const size_t first = m_name_offsets[name];
+		return MidiNoteView(*this, m_name_rows.data() + first, m_name_offsets[name + 1] - first);
+	}
+
+	return MidiNoteView(*this, NULL, 0);
+}
+
+void MidiNoteTable::FindOverlapping(microseconds_t from, microseconds_t to, vector<unsigned int> &rows, const MidiNoteFilter &filter) const
+{
+	if (to < from) return;
+	CollectOverlapping(0, m_starts.size(), from, to, rows, filter);
+}
+
+void MidiNoteTable::CollectOverlapping(size_t first, size_t last, microseconds_t from, microseconds_t to, vector<unsigned int> &rows,
+	const MidiNoteFilter &filter) const
+{
+	if (first >= last) return;
+
+	// Everything down here is over before the window
+	const size_t root = subtree_root(first, last);
+	if (m_max_ends[root] < from) return;
+
+	CollectOverlapping(first, root, from, to, rows, filter);
+
+	// This row and everything after it starts after the window
+	if (m_starts[root] > to) return;
+
+	if (m_ends[root] >= from
+		&& (filter.track_id == MidiNoteFilter::AnyTrack || filter.track_id == m_track_ids[root])
+		&& m_note_ids[root] >= filter.lowest_note && m_note_ids[root] <= filter.highest_note)
+	{
+		rows.push_back(static_cast<unsigned int>(root));
+	}
+
+	CollectOverlapping(root + 1, last, from, to, rows, filter);
+}
+
+TranslatedNote MidiNoteTable::Note(size_t row) const
+{
+	TranslatedNote note;
+	note.start = m_starts[row];
+	note.end = m_ends[row];
+	note.note_id = m_note_ids[row];
+	note.track_id = m_track_ids[row];
+	note.channel = m_channels[row];
+	note.bar_id = m_bar_ids[row];
+	note.velocity = m_velocities[row];
+	note.time_unit = m_time_units[row];
+	note.track_name = TrackName(row);
+	note.state = UserPlayable;
+
+	return note;
+}
+
+TranslatedNote MidiNoteView::Note(size_t i) const
+{
+	return m_table->Note(m_rows[i]);
+}
+
+void MidiNoteTable::FindStarts(microseconds_t from, microseconds_t to, size_t &first, size_t &last) const
+{
+	first = LowerBound(from);
+	last = (to <= from) ? first : static_cast<size_t>(lower_bound(m_starts.begin() + first, m_starts.end(), to) - m_starts.begin());
+}
@@ -0,0 +1,310 @@
+#ifndef __MIDI_NOTE_TABLE_H
+#define __MIDI_NOTE_TABLE_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "MidiTypes.h"
+#include "Note.h"
+
+class MidiNoteTable;
+class MidiMappedFile;
+
+// One column of a MidiNoteTable.  It's either an array of its own or one
+// borrowed from a mapped cache file (see MidiCache), which the table
+// keeps open.  Copies of a borrowed column borrow the same array.
+template <class T>
+class MidiNoteColumn
+{
+public:
+	MidiNoteColumn() : m_data(NULL), m_size(0) { }
+
+	MidiNoteColumn(const MidiNoteColumn &other) : m_values(other.m_values) { PointLike(other); }
+	MidiNoteColumn(MidiNoteColumn &&other) : m_values(std::move(other.m_values)), m_data(other.m_data), m_size(other.m_size) { other.Clear(); }
+
+	MidiNoteColumn &operator=(const MidiNoteColumn &other)
+	{
+		if (this == &other) return *this;
+
+		m_values = other.m_values;
+		PointLike(other);
+		return *this;
+	}
+
+	MidiNoteColumn &operator=(MidiNoteColumn &&other)
+	{
+		if (this == &other) return *this;
+
+		// Moving a vector keeps its array, so m_data stays good
+		m_values = std::move(other.m_values);
+		m_data = other.m_data;
+		m_size = other.m_size;
+		other.Clear();
+		return *this;
+	}
+
+	size_t size() const { return m_size; }
+	bool empty() const { return m_size == 0; }
+
+	const T &operator[](size_t i) const { return m_data[i]; }
+	const T &back() const { return m_data[m_size - 1]; }
+
+	const T *data() const { return m_data; }
+	const T *begin() const { return m_data; }
+	const T *end() const { return m_data + m_size; }
+
+	// Takes the array out of 'values'
+	void Own(std::vector<T> &values)
+	{
+		m_values.swap(values);
+		m_data = m_values.empty() ? NULL : &m_values[0];
+		m_size = m_values.size();
+	}
+
+	// 'data' has to outlive the column and every copy of it
+	void Borrow(const T *data, size_t size)
+	{
+		std::vector<T>().swap(m_values);
+		m_data = data;
+		m_size = size;
+	}
+
+	// For changing the values in place.  A borrowed array is copied into
+	// one of our own first.
+	T *MutableData()
+	{
+		MakeOwn();
+		return m_values.empty() ? NULL : &m_values[0];
+	}
+
+	void Resize(size_t size)
+	{
+		MakeOwn();
+		m_values.resize(size);
+		m_data = m_values.empty() ? NULL : &m_values[0];
+		m_size = size;
+	}
+
+private:
+	void MakeOwn()
+	{
+		if (m_size == 0 || (!m_values.empty() && m_data == &m_values[0])) return;
+
+		m_values.assign(m_data, m_data + m_size);
+		m_data = &m_values[0];
+	}
+
+	void PointLike(const MidiNoteColumn &other)
+	{
+		m_data = m_values.empty() ? other.m_data : &m_values[0];
+		m_size = other.m_size;
+	}
+
+	void Clear()
+	{
+		m_values.clear();
+		m_data = NULL;
+		m_size = 0;
+	}
+
+	std::vector<T> m_values;
+	const T *m_data;
+	size_t m_size;
+};
+
+// Which notes MidiNoteTable::FindOverlapping keeps.  By default, all.
+struct MidiNoteFilter
+{
+	const static unsigned int AnyTrack = static_cast<unsigned int>(-1);
+
+	MidiNoteFilter() : track_id(AnyTrack), lowest_note(0), highest_note(InvalidNoteId) { }
+
+	// Only notes from this track
+	unsigned int track_id;
+
+	// Only notes from lowest_note up to and including highest_note
+	NoteId lowest_note;
+	NoteId highest_note;
+};
+
+// New times for one row of a MidiNoteTable after a tempo edit (see
+// MidiNoteTable::Retime)
+struct MidiNoteRetime
+{
+	size_t row;
+
+	microseconds_t start;
+	microseconds_t end;
+	microseconds_t time_unit;
+	unsigned int bar_id;
+};
+
+// The rows of a MidiNoteTable that belong to one track (every track of
+// that name, to be exact), in table order.  It only points into the
+// table's index, so it's free to make and copy.  It's good for as long
+// as the table it came from stays as it is: merging notes into the
+// table, changing it in place or assigning over it leaves the view
+// pointing at rows that may not be there any more.
+class MidiNoteView
+{
+public:
+	MidiNoteView() : m_table(NULL), m_rows(NULL), m_count(0) { }
+	MidiNoteView(const MidiNoteTable &table, const unsigned int *rows, size_t count) : m_table(&table), m_rows(rows), m_count(count) { }
+
+	size_t Size() const { return m_count; }
+	bool Empty() const { return m_count == 0; }
+
+	// Table row of the i-th note
+	size_t Row(size_t i) const { return m_rows[i]; }
+
+	const unsigned int *begin() const { return m_rows; }
+	const unsigned int *end() const { return m_rows + m_count; }
+
+	// The i-th note the way Notes() has it, before anyone played it
+	TranslatedNote Note(size_t i) const;
+
+private:
+	const MidiNoteTable *m_table;
+	const unsigned int *m_rows;
+	size_t m_count;
+};
+
+// A song's translated notes with one array per field, in TranslatedNote
+// order (by start time, then end, note, channel and track).  A loop over
+// one field only touches that field's array, and the notes starting in
+// any stretch of time are one run of rows.
+//
+// This is where Midi keeps its notes; Midi::Notes() is made along with
+// it.  It has no note states, and keeps track names only once per track
+// (see FindTrack).
+class MidiNoteTable
+{
+public:
+	MidiNoteTable() { }
+
+	// 'notes' have to be in TranslatedNote order with no two alike, the
+	// way a TranslatedNoteSet has them
+	explicit MidiNoteTable(const std::vector<TranslatedNote> &notes);
+	explicit MidiNoteTable(const TranslatedNoteSet &notes);
+
+	size_t Size() const { return m_starts.size(); }
+	bool Empty() const { return m_starts.empty(); }
+
+	const MidiNoteColumn<microseconds_t> &Starts() const { return m_starts; }
+	const MidiNoteColumn<microseconds_t> &Ends() const { return m_ends; }
+	const MidiNoteColumn<NoteId> &NoteIds() const { return m_note_ids; }
+	const MidiNoteColumn<unsigned char> &Velocities() const { return m_velocities; }
+	const MidiNoteColumn<unsigned char> &Channels() const { return m_channels; }
+	const MidiNoteColumn<unsigned int> &TrackIds() const { return m_track_ids; }
+	const MidiNoteColumn<unsigned int> &BarIds() const { return m_bar_ids; }
+	const MidiNoteColumn<microseconds_t> &TimeUnits() const { return m_time_units; }
+
+	// All a track's notes have its name, so it's kept per track id
+	const MidiTrackName &TrackName(size_t row) const { return m_track_names[m_track_name_ids[m_track_ids[row]]]; }
+
+	// Row 'row' the way it went in, before anyone played it
+	TranslatedNote Note(size_t row) const;
+
+	// The row alike 'note' (see TranslatedNote), or Size() if none is
+	size_t FindRow(const TranslatedNote &note) const;
+
+	// The same, searching on from 'hint' (which mustn't be past the row),
+	// so a run of notes in order finds each row a few steps on from the
+	// last one instead of searching all the rows every time
+	size_t FindRow(const TranslatedNote &note, size_t hint) const;
+
+	// Adds 'notes' (in TranslatedNote order with no two alike) to the
+	// table.  Of a note and a row that are alike, the row stays.  Only
+	// the rows from the first new note on are written again, so adding
+	// notes near the end (the way a progressive load does) is cheap.
+	void Merge(const std::vector<TranslatedNote> &notes);
+
+	// Puts in the times a tempo edit gave the notes (see
+	// Midi::SetTempoChange): the rows in 'rows' (in row order, all before
+	// 'shift_row') get the times given there, and every row from
+	// 'shift_row' on moves by 'delta'.  Nothing else is touched: the rows
+	// stay where they are, so only m_max_ends is made again.  If that
+	// would put two rows out of order (or make them alike) it returns
+	// false without changing anything, and the table has to be built
+	// over again.
+	bool Retime(const std::vector<MidiNoteRetime> &rows, size_t shift_row, microseconds_t delta);
+
+	// First row starting at or after 'start'
+	size_t LowerBound(microseconds_t start) const;
+
+	// Rows [first, last) are the notes starting in [from, to)
+	void FindStarts(microseconds_t from, microseconds_t to, size_t &first, size_t &last) const;
+
+	// The notes of the tracks called 'track_name'.  The rows are grouped
+	// by name when the table is built, one group per distinct name, so
+	// this only compares against each name once and finds every track
+	// that has it.
+	MidiNoteView FindTrack(const std::string &track_name) const;
+
+	// Appends to 'rows', in table order, every note sounding at some point
+	// in [from, to] (starting by 'to' and ending no earlier than 'from')
+	// that passes 'filter'.  Long notes that started well before the
+	// window are found too, without walking everything before it: the
+	// rows form an implicit balanced tree that knows the latest end under
+	// each node (see m_max_ends), so whole stretches that end too early or
+	// start too late are skipped at once.
+	void FindOverlapping(microseconds_t from, microseconds_t to, std::vector<unsigned int> &rows,
+		const MidiNoteFilter &filter = MidiNoteFilter()) const;
+
+private:
+	friend class MidiCache;
+
+	// Adds rows for 'count' notes that all go after the rows already here
+	template <class NoteIterator>
+	void Append(NoteIterator first, NoteIterator last, size_t count);
+
+	// Cuts the table down to its first 'count' rows, leaving the index
+	// to be made again
+	void Truncate(size_t count);
+
+	// Whether row 'row' comes before 'note' in TranslatedNote order
+	bool RowBefore(size_t row, const TranslatedNote &note) const;
+	size_t FirstRowNotBefore(const TranslatedNote &note, size_t from = 0) const;
+
+	// Whether row 'row' - 1 comes before row 'row' in TranslatedNote
+	// order if they had the times given
+	bool RowsInOrder(size_t row, microseconds_t previous_start, microseconds_t previous_end, microseconds_t start, microseconds_t end) const;
+
+	// Makes m_max_ends from the rows
+	void BuildMaxEnds();
+
+	// Makes the rows of each name (m_name_offsets, m_name_rows)
+	void BuildNameIndex();
+
+	void CollectOverlapping(size_t first, size_t last, microseconds_t from, microseconds_t to, std::vector<unsigned int> &rows,
+		const MidiNoteFilter &filter) const;
+
+	MidiNoteColumn<microseconds_t> m_starts;
+	MidiNoteColumn<microseconds_t> m_ends;
+	MidiNoteColumn<NoteId> m_note_ids;
+	MidiNoteColumn<unsigned char> m_velocities;
+	MidiNoteColumn<unsigned char> m_channels;
+	MidiNoteColumn<unsigned int> m_track_ids;
+	MidiNoteColumn<unsigned int> m_bar_ids;
+	MidiNoteColumn<microseconds_t> m_time_units;
+
+	// Rows [first, last) form a subtree rooted at the middle row, with
+	// the rows before and after it as its two subtrees.  This holds the
+	// latest end anywhere in the subtree rooted at each row.
+	MidiNoteColumn<microseconds_t> m_max_ends;
+
+	// The notes' distinct track names, and the rows of each:
+	// m_name_rows[m_name_offsets[i]] up to m_name_rows[m_name_offsets[i + 1]]
+	std::vector<MidiTrackName> m_track_names;
+	MidiNoteColumn<unsigned int> m_track_name_ids;
+	MidiNoteColumn<size_t> m_name_offsets;
+	MidiNoteColumn<unsigned int> m_name_rows;
+
+	// The cache file the columns are borrowed from, if they are
+	std::shared_ptr<MidiMappedFile> m_mapping;
+};
+
+#endif
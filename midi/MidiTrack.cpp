@@ -1,15 +1,89 @@
 #include "MidiTrack.h"
 #include "MidiEvent.h"
 #include "MidiUtil.h"
+#include "MidiByteCursor.h"
 #include "Midi.h"
 
-#include <sstream>
+#include <vector>
 #include <string>
 #include <map>
+#include <algorithm>
+#include <utility>
 
 using namespace std;
 
+// Equal as far as the note ordering goes (see NoteList)
+static bool same_note(const MidiTrackNote &lhs, const MidiTrackNote &rhs)
+{
+	MidiTrackNote less;
+	return !less(lhs, rhs) && !less(rhs, lhs);
+}
+
+// Puts 'note' in its place in 'notes' unless an equal one is there
+// already.  Notes mostly arrive about in order, so that's near the end.
+static bool insert_note(NoteList &notes, const MidiTrackNote &note)
+{
+	NoteList::iterator at = upper_bound(notes.begin(), notes.end(), note, MidiTrackNote());
+	if (at != notes.begin() && same_note(*(at - 1), note)) return false;
+
+	notes.insert(at, note);
+	return true;
+}
+
+// The way Notes() has 'note'
+static MidiLS::Note set_note(const MidiTrackNote &note, const string &track_name)
+{
+	MidiLS::Note n;
+	n.start = note.start;
+	n.end = note.end;
+	n.note_id = note.note_id;
+	n.track_id = note.track_id;
+	n.channel = note.channel;
+	n.bar_id = 0;
+	n.velocity = note.velocity;
+	n.time_unit = 0;
+	n.track_name = track_name;
+	n.state = UserPlayable;
+
+	return n;
+}
+
+MidiTrack::MidiTrack(const MidiTrack &other) :
+	m_events(other.m_events),
+	m_event_pulses(other.m_event_pulses),
+	m_event_usecs(other.m_event_usecs),
+	m_change_play(other.m_change_play),
+	m_initial_microseconds(other.m_initial_microseconds),
+	m_end_microseconds(other.m_end_microseconds),
+	m_loop_start_microseconds(other.m_loop_start_microseconds),
+	m_loop_end_microseconds(other.m_loop_end_microseconds),
+	m_track_name(other.m_track_name),
+	m_notes(other.m_notes),
+	m_note_set(other.m_note_set),
+	m_instrument_id(other.m_instrument_id),
+	m_running_microseconds(other.m_running_microseconds),
+	m_last_event(other.m_last_event),
+	m_notes_remaining(other.m_notes_remaining)
+{
+}
+
+MidiTrack &MidiTrack::operator=(const MidiTrack &other)
+{
+	if (this == &other) return *this;
+
+	MidiTrack copy(other);
+	return *this = std::move(copy);
+}
+
 MidiTrack MidiTrack::ReadFromStream(std::istream &stream)
+{
+	vector<unsigned char> buffer;
+	ReadChunkFromStream(stream, buffer);
+
+	return ReadFromMemory(buffer.empty() ? NULL : &buffer[0], buffer.size());
+}
+
+void MidiTrack::ReadChunkFromStream(std::istream &stream, std::vector<unsigned char> &body)
 {
 	// Verify the track header
 	const static string MidiTrackHeader = "MTrk";
@@ -27,36 +101,46 @@ MidiTrack MidiTrack::ReadFromStream(std::istream &stream)
 	if (stream.fail()) throw MidiError(MidiError_TrackHeaderTooShort);
 
 	string header(header_id);
-	if (header != MidiTrackHeader) throw MidiError_BadTrackHeaderType;
+	if (header != MidiTrackHeader) throw MidiError(MidiError_BadTrackHeaderType);
 
 	// Pull the full track out of the file all at once -- there is an
 	// End-Of-Track event, but this allows us handle malformed MIDI a
 	// little more gracefully.
 	track_length = swap32(track_length);
-	char *buffer = new char[track_length + 1];
-	buffer[track_length] = 0;
+	body.resize(track_length);
 
-	stream.read(buffer, track_length);
-	if (stream.fail())
-	{
-		delete[] buffer;
-		throw MidiError(MidiError_TrackTooShort);
-	}
+	if (track_length > 0) stream.read(reinterpret_cast<char*>(&body[0]), track_length);
+	if (stream.fail()) throw MidiError(MidiError_TrackTooShort);
+}
+
+size_t MidiTrack::ReadChunkHeader(const unsigned char *&position, const unsigned char *end)
+{
+	// "MTrk" followed by a 32-bit big endian body length
+	const static size_t ChunkHeaderLength = 8;
 
-	// We have to jump through a couple hoops because istringstream
-	// can't handle binary data unless constructed through an std::string. 
-	string buffer_string(buffer, track_length);
-	istringstream event_stream(buffer_string, ios::binary);
-	delete[] buffer;
+	if (static_cast<size_t>(end - position) < ChunkHeaderLength) throw MidiError(MidiError_TrackHeaderTooShort);
+	if (position[0] != 'M' || position[1] != 'T' || position[2] != 'r' || position[3] != 'k') throw MidiError(MidiError_BadTrackHeaderType);
+
+	size_t track_length = read_big_endian32(position + 4);
+	position += ChunkHeaderLength;
+
+	if (static_cast<size_t>(end - position) < track_length) throw MidiError(MidiError_TrackTooShort);
+
+	return track_length;
+}
+
+MidiTrack MidiTrack::ReadFromMemory(const unsigned char *data, size_t length, size_t track_id)
+{
+	MidiByteCursor cursor(data, length);
 
 	MidiTrack t;
 
 	// Read events until we run out of track
-	char last_status = 0;
+	unsigned char last_status = 0;
 	unsigned long current_pulse_count = 0;
-	while (event_stream.peek() != char_traits<char>::eof())
+	while (!cursor.AtEnd())
 	{
-		MidiEvent ev = MidiEvent::ReadFromStream(event_stream, last_status); 
+		MidiEvent ev = MidiEvent::ReadFromCursor(cursor, last_status, t.Arena());
 		last_status = ev.StatusCode();
 
 		t.m_events.push_back(ev);
@@ -66,7 +150,20 @@ MidiTrack MidiTrack::ReadFromStream(std::istream &stream)
 		t.m_event_pulses.push_back(current_pulse_count);
 	}
 
-	t.BuildNoteSet();
+	// Named before the notes are made, so they can share it from the start
+	string track_name;
+	for (MidiEventList::const_iterator i = t.m_events.begin(); i != t.m_events.end(); ++i)
+	{
+		if (i->MetaType() != MidiMetaEvent_TrackName) continue;
+
+		track_name = i->Text();
+		break;
+	}
+
+	t.m_track_name = MidiTrackName(track_name);
+	t.ShareTrackName();
+
+	t.BuildNoteSet(track_id);
 	t.DiscoverInstrument();
 
 	return t;
@@ -83,9 +180,14 @@ bool MidiTrack::LinkMidiTrack(MidiTrack &track, unsigned long delta, unsigned lo
 	list_events.begin()->SetDeltaPulses(this->m_events.back().GetDeltaPulses() + delta);
 
 
+	// They're ours now, so they go by our name
+	MidiEvent named;
+	named.setTrackName(m_track_name);
+
 	this->m_events.pop_back();
 	for (auto e : list_events)
 	{
+		e.ShareTrackName(named);
 		this->m_events.push_back(e);
 	}
 
@@ -116,88 +218,71 @@ bool MidiTrack::LinkMidiTrack(MidiTrack &track, unsigned long delta, unsigned lo
 	}
 
 
-	if (usecs < this->m_note_set.cbegin()->start)
+	if (usecs < this->m_notes.front().start)
 	{
 		return false;
 	}
-	NoteSet list_notes = track.Notes();
-	for (auto n : list_notes)
+	const unsigned int track_id = this->m_notes.front().track_id;
+	const size_t old_count = this->m_notes.size();
+	for (auto n : track.SortedNotes())
 	{
 		n.start += pulses;
 		n.end += pulses;
-		n.track_id = this->m_note_set.begin()->track_id;
-		this->m_note_set.insert(n);
+		n.track_id = track_id;
+		this->m_notes.push_back(n);
 	}
 
+	// Both halves are sorted already.  Where two notes are the same, the
+	// one we had first stays.
+	inplace_merge(this->m_notes.begin(), this->m_notes.begin() + old_count, this->m_notes.end(), MidiTrackNote());
+	this->m_notes.erase(unique(this->m_notes.begin(), this->m_notes.end(), same_note), this->m_notes.end());
+
+	FillNoteSet();
 
-	this->m_notes_remaining = this->m_note_set.size();
+	this->m_notes_remaining = this->m_notes.size();
 
 	return true;
 }
 
-struct NoteInfo
+void MidiTrack::BuildNoteSet(size_t track_id)
 {
-	int velocity;
-	unsigned char channel;
-	unsigned long pulses;
-};
-
-void MidiTrack::BuildNoteSet()
-{
-	m_note_set.clear();
-
-	// Keep a list of all the notes currently "on" (and the pulse that
-	// it was started).  On a note_on event, we create an element.  On
-	// a note_off event we check that an element exists, make a "Note",
-	// and remove the element from the list.  If there is already an
-	// element on a note_on we both cap off the previous "Note" and
-	// begin a new one.
+	m_notes.clear();
+
+	// Keep track of all the notes currently "on" (and the pulse that
+	// it was started), per channel and pitch.  On a note_on event, we
+	// fill in a slot.  On a note_off event we check that the slot is in
+	// use, make a "Note", and free the slot.  If the slot is already in
+	// use on a note_on we both cap off the previous "Note" and begin a
+	// new one.
 	//
 	// A note_on with velocity 0 is a note_off
-	std::map<NoteId, NoteInfo> m_active_notes;
+	MidiNotePairing active_notes;
 
+	// There can't be more notes than note-ons
+	size_t note_on_count = 0;
 	for (size_t i = 0; i < m_events.size(); ++i)
 	{
-		const MidiEvent &ev = m_events[i];
-		if (ev.Type() != MidiEventType_NoteOn && ev.Type() != MidiEventType_NoteOff) continue;
-
-		bool on = (ev.Type() == MidiEventType_NoteOn && ev.NoteVelocity() > 0);
-		NoteId id = ev.NoteNumber();
+		if (m_events[i].Type() == MidiEventType_NoteOn) ++note_on_count;
+	}
 
-		// Check for an active note
-		std::map<NoteId, NoteInfo>::iterator find_ret = m_active_notes.find(id);
-		bool active_event = (find_ret !=  m_active_notes.end());
+	m_notes.reserve(note_on_count);
 
-		// Close off the last event if there was one
-		if (active_event)
-		{
-			MidiLS::Note n;
-			n.start = find_ret->second.pulses;
-			n.end = m_event_pulses[i];
-			n.note_id = id;
-			n.channel = find_ret->second.channel;
-			n.velocity = find_ret->second.velocity;
-
-			// NOTE: This must be set at the next level up.  The track
-			// itself has no idea what its index is.
-			n.track_id = 0;
-
-			// Add a note and remove this NoteId from the active list
-			m_note_set.insert(n);
-			m_active_notes.erase(find_ret);
-		}
+	for (size_t i = 0; i < m_events.size(); ++i)
+	{
+		MidiTrackNote n;
+		if (!PairNoteEvent(i, active_notes, n)) continue;
 
-		// We've handled any active events.  If this was a note_off we're done.
-		if (!on) continue;
+		n.track_id = static_cast<unsigned int>(track_id);
+		m_notes.push_back(n);
+	}
 
-		// Add a new active event
-		NoteInfo info;
-		info.channel = ev.Channel();
-		info.velocity = ev.NoteVelocity();
-		info.pulses = m_event_pulses[i];
+	// Notes close in order of their ends, so they're sorted once at the
+	// end.  The sort is stable so that, like a set, the first of two
+	// equal notes is the one kept.
+	stable_sort(m_notes.begin(), m_notes.end(), MidiTrackNote());
+	m_notes.erase(unique(m_notes.begin(), m_notes.end(), same_note), m_notes.end());
 
-		m_active_notes[id] = info;
-	}
+	FillNoteSet();
 
 	// NOTE: No reason to report this error. It's non-critical
 	// so there is no reason we need to shut down for it.
@@ -205,13 +290,103 @@ void MidiTrack::BuildNoteSet()
 	// MIDI files.  As-is, a note just won't be inserted if
 	// it isn't closed properly.
 	/*
-	if (m_active_notes.size() > 0)
+	if (active notes left over)
 	{
 	throw MidiError(MidiError_UnresolvedNoteEvents);
 	}
 	*/
 }
 
+bool MidiTrack::PairNoteEvent(size_t event_index, MidiNotePairing &active_notes, MidiTrackNote &note) const
+{
+	const MidiEvent &ev = m_events[event_index];
+	if (ev.Type() != MidiEventType_NoteOn && ev.Type() != MidiEventType_NoteOff) return false;
+
+	bool on = (ev.Type() == MidiEventType_NoteOn && ev.NoteVelocity() > 0);
+	NoteId id = ev.NoteNumber();
+
+	// Check for an active note on this channel
+	NoteInfo &slot = active_notes.Slot(ev.Channel(), id);
+	bool active_event = slot.active;
+
+	// Close off the last event if there was one
+	if (active_event)
+	{
+		note.start = slot.pulses;
+		note.end = m_event_pulses[event_index];
+		note.note_id = id;
+		note.channel = slot.channel;
+		note.velocity = static_cast<unsigned char>(slot.velocity);
+
+		// Free the slot
+		slot.active = false;
+	}
+
+	// We've handled any active events.  If this was a note_off we're done.
+	if (on)
+	{
+		// Start a new active event
+		slot.channel = ev.Channel();
+		slot.velocity = ev.NoteVelocity();
+		slot.pulses = m_event_pulses[event_index];
+		slot.active = true;
+	}
+
+	return active_event;
+}
+
+void MidiTrack::DecodeUntil(MidiTrackDecodeState &state, unsigned long until_pulses, size_t track_id, NoteList &new_notes)
+{
+	MidiEvent named;
+	named.setTrackName(m_track_name);
+
+	while (!state.finished)
+	{
+		// Look at the delta-time first: if the next event lies past the
+		// horizon we leave it where it is for next time.  (Decoding it
+		// would put its text in the arena for nothing.)
+		MidiByteCursor peek(state.data + state.offset, state.length - state.offset);
+		unsigned long ev_pulses = state.pulses + peek.ReadVariableLength();
+		if (ev_pulses > until_pulses) return;
+
+		MidiByteCursor cursor(state.data + state.offset, state.length - state.offset);
+		MidiEvent ev = MidiEvent::ReadFromCursor(cursor, state.last_status, Arena());
+
+		state.offset += cursor.Offset();
+		state.last_status = ev.StatusCode();
+		state.pulses = ev_pulses;
+		state.finished = (state.offset >= state.length);
+
+		// These live in the meter and tempo tracks.  Hand their delta
+		// on to the next event we keep.
+		if (ev.Type() == MidiEventType_Meta &&
+			(ev.MetaType() == MidiMetaEvent_TimeSignature || ev.MetaType() == MidiMetaEvent_TempoChange))
+		{
+			state.skipped_delta += ev.GetDeltaPulses();
+			continue;
+		}
+
+		ev.SetDeltaPulses(ev.GetDeltaPulses() + state.skipped_delta);
+		state.skipped_delta = 0;
+
+		ev.ShareTrackName(named);
+		m_events.push_back(ev);
+		m_event_pulses.push_back(ev_pulses);
+
+		MidiTrackNote n;
+		if (PairNoteEvent(m_events.size() - 1, state.active_notes, n))
+		{
+			n.track_id = static_cast<unsigned int>(track_id);
+
+			if (!insert_note(m_notes, n)) continue;
+
+			MutableNoteSet().insert(set_note(n, m_track_name));
+			new_notes.push_back(n);
+			++m_notes_remaining;
+		}
+	}
+}
+
 void MidiTrack::DiscoverInstrument()
 {
 	// Default to Program 0 per the MIDI Standard
@@ -272,43 +447,69 @@ void MidiTrack::DiscoverInstrument()
 
 void MidiTrack::SetTrackId(size_t track_id)
 {
-	MidiLS::Note n;
-	NoteSet::iterator label;
+	// The whole track has the one id, so the order stays the same
+	for (NoteList::iterator i = m_notes.begin(); i != m_notes.end(); ++i) i->track_id = static_cast<unsigned int>(track_id);
 
-	for (NoteSet::iterator i = m_note_set.begin(); i != m_note_set.end(); )
-	{
-		n = *i;
-		n.track_id = track_id;
-		label = i++;
-		m_note_set.erase(label);
-		m_note_set.insert(n);
-	}
-	return;
+	FillNoteSet();
 }
 
-
 void MidiTrack::SetTrackName(std::string track_name)
 {
-	MidiLS::Note n;
-	NoteSet::iterator label;
+	if (m_track_name.IsSet() && m_track_name == track_name) return;
+
+	// The old name is left as it was for anything else sharing it
+	m_track_name = MidiTrackName(track_name);
+	ShareTrackName();
+
+	FillNoteSet();
+}
+
+void MidiTrack::ShareTrackName()
+{
+	// Channel messages all end up sharing this one payload
+	MidiEvent named;
+	named.setTrackName(m_track_name);
 
-	for (NoteSet::iterator i = m_note_set.begin(); i != m_note_set.end(); )
+	for (MidiEventList::iterator i = m_events.begin(); i != m_events.end(); ++i)
 	{
-		n = *i;
-		n.track_name = track_name;
-		label = i++;
-		m_note_set.erase(label);
-		m_note_set.insert(n);
+		i->ShareTrackName(named);
 	}
-	
-	for (MidiEventList::iterator i = m_events.begin(); i != m_events.end(); ++i)
+}
+
+const NoteSet &MidiTrack::Notes() const
+{
+	const static NoteSet NoNotes;
+	return m_note_set ? *m_note_set : NoNotes;
+}
+
+void MidiTrack::FillNoteSet()
+{
+	if (m_notes.empty())
 	{
-		i->setTrackName(track_name);
+		m_note_set.reset();
+		return;
 	}
 
-	m_track_name = track_name;
+	// A new set rather than clearing this one, which copies may share.
+	// The notes are in order, so each one goes on the end.
+	shared_ptr<NoteSet> notes = make_shared<NoteSet>();
+	for (NoteList::const_iterator i = m_notes.begin(); i != m_notes.end(); ++i) notes->insert(notes->end(), set_note(*i, m_track_name));
 
-	return;
+	m_note_set = notes;
+}
+
+NoteSet &MidiTrack::MutableNoteSet()
+{
+	if (!m_note_set) m_note_set = make_shared<NoteSet>();
+	else if (m_note_set.use_count() > 1) m_note_set = make_shared<NoteSet>(*m_note_set);
+
+	return *m_note_set;
+}
+
+const shared_ptr<MidiArena> &MidiTrack::Arena()
+{
+	if (!m_arena) m_arena = MidiArena::Create();
+	return m_arena;
 }
 
 void MidiTrack::Reset()
@@ -322,7 +523,7 @@ void MidiTrack::Reset()
 	m_running_microseconds = 0;
 	m_last_event = -1;
 
-	m_notes_remaining = static_cast<unsigned int>(m_note_set.size());
+	m_notes_remaining = static_cast<unsigned int>(m_notes.size());
 }
 
 MidiEventList MidiTrack::Update(microseconds_t delta_microseconds)
@@ -358,7 +559,7 @@ void MidiTrack::Reset(microseconds_t start_time, microseconds_t end_time)
 	m_loop_start_microseconds = 0;
 	m_loop_end_microseconds = 0;
 
-	m_notes_remaining = static_cast<unsigned int>(m_note_set.size());
+	m_notes_remaining = static_cast<unsigned int>(m_notes.size());
 }
 
 MidiEventList MidiTrack::Update(microseconds_t delta_microseconds, bool loop)			// ����
@@ -3,6 +3,7 @@
 
 #include <vector>
 #include <iostream>
+#include <map>
 
 #include "Note.h"
 #include "MidiEvent.h"
@@ -16,12 +17,104 @@ typedef std::vector<unsigned long> MidiEventPulsesList;
 typedef std::vector<microseconds_t> MidiEventMicrosecondList;
 
 
+// A note that has started (note-on) but not yet been closed off
+struct NoteInfo
+{
+	NoteInfo() : velocity(0), channel(0), active(false), pulses(0) { }
+
+	int velocity;
+	unsigned char channel;
+
+	// False for a free slot in MidiNotePairing
+	bool active;
+
+	unsigned long pulses;
+};
+
+// The notes sounding on each channel and pitch while a track is paired
+// up into notes: one slot per channel and pitch, so pairing an event is
+// a single index instead of a tree lookup.  A channel's slots are only
+// set up once it's used, since most tracks stick to one or two.
+//
+// Real pitches are under 128, but a broken file can have any byte there
+// and those notes pair up the same as always, so there's a slot for
+// every byte.
+class MidiNotePairing
+{
+public:
+	const static size_t ChannelCount = 16;
+	const static size_t NoteCount = 256;
+
+	// 'note_id' is a data byte, so always under NoteCount
+	NoteInfo &Slot(unsigned char channel, NoteId note_id)
+	{
+		std::vector<NoteInfo> &slots = m_channels[channel & 0x0F];
+		if (slots.empty()) slots.resize(NoteCount);
+
+		return slots[note_id];
+	}
+
+private:
+	std::vector<NoteInfo> m_channels[ChannelCount];
+};
+
+// How far we've got through a track chunk when it's being decoded a
+// piece at a time (see Midi::BeginProgressiveLoad).  The chunk bytes
+// are owned by whoever handed them over and must outlive the state.
+struct MidiTrackDecodeState
+{
+	MidiTrackDecodeState() : data(NULL), length(0), offset(0), last_status(0), pulses(0), skipped_delta(0), finished(false) { }
+	MidiTrackDecodeState(const unsigned char *chunk, size_t chunk_length) : data(chunk), length(chunk_length), offset(0),
+		last_status(0), pulses(0), skipped_delta(0), finished(chunk_length == 0) { }
+
+	const unsigned char *data;
+	size_t length;
+	size_t offset;
+
+	unsigned char last_status;
+
+	// Absolute pulse of the last event read
+	unsigned long pulses;
+
+	// Delta-time of events we dropped, owed to the next one we keep
+	unsigned long skipped_delta;
+
+	MidiNotePairing active_notes;
+
+	bool finished;
+};
+
 class MidiTrack
 {
 public:
 	static MidiTrack ReadFromStream(std::istream &stream);
+
+	// Decodes a track straight out of an in-memory "MTrk" chunk body
+	// (everything after the 8-byte chunk header).  The bytes are only
+	// read in place, never copied.  Its notes are made with 'track_id'
+	// and the name from the track's first track-name event.
+	static MidiTrack ReadFromMemory(const unsigned char *data, size_t length, size_t track_id = 0);
+
+	// Validates the "MTrk" chunk header at position and returns the
+	// length of the track body that follows it.  position is moved past
+	// the header, so the body starts there.
+	static size_t ReadChunkHeader(const unsigned char *&position, const unsigned char *end);
+
+	// Reads the next "MTrk" chunk off the stream, leaving just its
+	// body in 'body' for ReadFromMemory.
+	static void ReadChunkFromStream(std::istream &stream, std::vector<unsigned char> &body);
+
 	static MidiTrack CreateBlankTrack() { return MidiTrack(); }
 
+	// A copy shares the events (see MidiEvent), notes and name of the
+	// original, so it's only a copy of the arrays.  It gets an arena of
+	// its own once it needs one (see Arena).
+	MidiTrack(const MidiTrack &other);
+	MidiTrack(MidiTrack &&other) = default;
+
+	MidiTrack &operator=(const MidiTrack &other);
+	MidiTrack &operator=(MidiTrack &&other) = default;
+
 
 	bool LinkMidiTrack(MidiTrack &track, unsigned long delta, unsigned long pulses, microseconds_t usecs);
 
@@ -35,19 +128,43 @@ public:
 
 	void SetEventUsecs(const MidiEventMicrosecondList &event_usecs) { m_event_usecs = event_usecs; }
 
+	// Decodes events from 'state' up to and including 'until_pulses' and
+	// appends them to this track.  Tempo and time signature events are
+	// left out, the same way Midi moves them into their own tracks.
+	// Notes closed along the way are tagged with track_id, added to
+	// SortedNotes() and Notes() and also to 'new_notes'.
+	//
+	// Appended events have no EventUsecs() yet; the caller fills those
+	// in for everything past the old event count.
+	void DecodeUntil(MidiTrackDecodeState &state, unsigned long until_pulses, size_t track_id, NoteList &new_notes);
+
+	// Call once DecodeUntil has reached the end of the chunk
+	void FinishDecoding() { DiscoverInstrument(); }
+
 	const std::wstring InstrumentName() const { return InstrumentNames[m_instrument_id]; }
 	bool IsPercussion() const { return m_instrument_id == InstrumentIdPercussion; }
 
-	const NoteSet &Notes() const { return m_note_set; }
+	// The notes with their track name, made along with SortedNotes()
+	const NoteSet &Notes() const;
 
+	// The same notes as one flat array, in order.  Loops over a track's
+	// notes go through this.
+	const NoteList &SortedNotes() const { return m_notes; }
+
+	// Loading gives the notes their track id as they're made; this is
+	// only for moving a track somewhere else afterwards.
 	void SetTrackId(size_t track_id);
+
+	// The events of a track share its name (see MidiTrackName).  Renaming
+	// gives the track a new one and points its events at that, so copies
+	// still sharing the old name (and whatever Midi they're in) keep it.
 	void SetTrackName(std::string track_name);																				// ������������
 
 
-	std::string GetTrackName(void) { return m_track_name; }
+	std::string GetTrackName(void) const { return m_track_name.Text(); }
 
 
-	bool hasNotes() const { return (m_note_set.size() > 0); }
+	bool hasNotes() const { return (m_notes.size() > 0); }
 
 	void Reset();
 	void Reset(microseconds_t start_time, microseconds_t end_time);															// ����
@@ -65,14 +182,35 @@ public:
 	unsigned int AggregateEventCount() const { return static_cast<unsigned int>(m_events.size()); }
 
 	unsigned int AggregateNotesRemain() const { return m_notes_remaining; }
-	unsigned int AggregateNoteCount() const { return static_cast<unsigned int>(m_note_set.size()); }
+	unsigned int AggregateNoteCount() const { return static_cast<unsigned int>(m_notes.size()); }
 
 private:
+	friend class MidiCache;
+
 	MidiTrack() : m_instrument_id(0), m_change_play(false)  { Reset(); }
 
-	void BuildNoteSet();
+	void BuildNoteSet(size_t track_id);
 	void DiscoverInstrument();
 
+	// Points every event at m_track_name
+	void ShareTrackName();
+
+	// Makes Notes() over again from m_notes
+	void FillNoteSet();
+
+	// Notes(), to add to.  Copies of the track that share it keep theirs.
+	NoteSet &MutableNoteSet();
+
+	// Where decoded event text goes.  It's made the first time something
+	// is decoded into this track, and not shared with copies of it, so
+	// two copies can carry on decoding on different threads.
+	const std::shared_ptr<MidiArena> &Arena();
+
+	// Runs event 'event_index' through the note pairing used by
+	// BuildNoteSet.  Returns true (and fills 'note', all but its track id)
+	// if it closed a note.
+	bool PairNoteEvent(size_t event_index, MidiNotePairing &active_notes, MidiTrackNote &note) const;
+
 	MidiEventList m_events;
 	MidiEventPulsesList m_event_pulses;
 	MidiEventMicrosecondList m_event_usecs;
@@ -85,9 +223,16 @@ private:
 	microseconds_t m_loop_start_microseconds;
 	microseconds_t m_loop_end_microseconds;
 
-	std::string m_track_name;
+	MidiTrackName m_track_name;
+
+	// Sorted, see NoteList
+	NoteList m_notes;
+
+	// Notes(), shared by copies of the track
+	std::shared_ptr<NoteSet> m_note_set;
 
-	NoteSet m_note_set;
+	// Where the text of the track's events goes (see Arena)
+	std::shared_ptr<MidiArena> m_arena;
 
 	int m_instrument_id;
 
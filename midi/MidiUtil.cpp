@@ -1,5 +1,10 @@
 ﻿#include "MidiUtil.h"
 
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <vector>
+
 using namespace std;
 
 
@@ -41,6 +46,57 @@ unsigned long parse_variable_length(istream &in)
    return(value);
 }
 
+unsigned long read_big_endian32(const unsigned char *bytes)
+{
+   return ((static_cast<unsigned long>(bytes[0]) << 24) |
+           (static_cast<unsigned long>(bytes[1]) << 16) |
+           (static_cast<unsigned long>(bytes[2]) << 8 ) |
+           (static_cast<unsigned long>(bytes[3])      ));
+}
+
+unsigned short read_big_endian16(const unsigned char *bytes)
+{
+   return static_cast<unsigned short>((bytes[0] << 8) | bytes[1]);
+}
+
+void run_parallel(size_t job_count, unsigned int worker_count, const std::function<void(size_t)> &job)
+{
+   if (worker_count == 0) worker_count = std::thread::hardware_concurrency();
+   if (worker_count == 0) worker_count = 1;
+   if (worker_count > job_count) worker_count = static_cast<unsigned int>(job_count);
+
+   // Not worth spinning up threads for
+   if (worker_count <= 1)
+   {
+      for (size_t i = 0; i < job_count; ++i) job(i);
+      return;
+   }
+
+   std::atomic<size_t> next_job(0);
+   std::vector<std::exception_ptr> errors(job_count);
+
+   std::function<void()> worker = [&]()
+   {
+      for (size_t i = next_job++; i < job_count; i = next_job++)
+      {
+         try { job(i); }
+         catch (...) { errors[i] = std::current_exception(); }
+      }
+   };
+
+   // The calling thread does its share of the work too
+   std::vector<std::thread> threads;
+   for (unsigned int i = 1; i < worker_count; ++i) threads.push_back(std::thread(worker));
+   worker();
+
+   for (size_t i = 0; i < threads.size(); ++i) threads[i].join();
+
+   for (size_t i = 0; i < job_count; ++i)
+   {
+      if (errors[i]) std::rethrow_exception(errors[i]);
+   }
+}
+
 std::wstring MidiError::GetErrorDescription() const
 {
    switch (m_error)
@@ -76,6 +132,16 @@ std::wstring MidiError::GetErrorDescription() const
 
    case MidiError_RequestedTempoFromNonTempoEvent:    return L"Tempo data was requested from a non-tempo MIDI event.";
    case MidiError_UnresolvedNoteEvents:               return L"Found a 'note on' event without a matching 'note off'.";
+   case MidiError_BadTempo:                           return L"Tempo must be between 1 and 16777215 microseconds per quarter note.";
+
+   case MidiError_OutOfMemory:                        return L"Ran out of memory while loading the MIDI file.";
+   case MidiError_LoadFailed:                         return L"An unexpected error occurred while loading the MIDI file.";
+
+   case MidiError_BadCacheFile:                       return L"The song cache file is damaged or truncated.";
+   case MidiError_StaleCacheFile:                     return L"The song cache file was written by a different version of the library.";
+   case MidiError_CacheWriteFailed:                   return L"Could not write the song cache file.";
+
+   case MidiError_UnsupportedSmpteRate:               return L"MIDI uses an SMPTE frame rate that isn't supported.";
 
    default:                                           return WSTRING(L"Unknown MidiError Code (" << m_error << L").");
    }
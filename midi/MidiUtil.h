@@ -3,6 +3,7 @@
 
 #include <iostream>
 #include <string>
+#include <functional>
 
 // =====================================
 //#include <atlstr.h>
@@ -25,6 +26,17 @@
 // byte, and the last bit is a kind of "keep going" flag.
 unsigned long parse_variable_length(std::istream &in);
 
+// Read big endian values straight out of a byte buffer (for
+// headers decoded from memory instead of through a stream).
+unsigned long read_big_endian32(const unsigned char *bytes);
+unsigned short read_big_endian16(const unsigned char *bytes);
+
+// Runs job(0) .. job(job_count - 1) on up to worker_count threads
+// (0 means one per core).  Jobs are handed out in index order and the
+// call returns once every job has finished.  If any job throws, the
+// exception from the lowest-numbered failing job is rethrown here.
+void run_parallel(size_t job_count, unsigned int worker_count, const std::function<void(size_t)> &job);
+
 #ifndef STRING
 #include <sstream>
 #define STRING(v) ((static_cast<std::ostringstream&>(std::ostringstream().flush() << v)).str())
@@ -48,6 +60,8 @@ enum MidiErrorCode
    MidiError_BadHeaderSize,
    MidiError_Type2MidiNotSupported,
    MidiError_BadType0Midi,
+   // No longer thrown (SMPTE time is loaded, see TempoMap), kept so the
+   // codes that follow keep their values
    MidiError_SMTPETimingNotImplemented,
 
    MidiError_TrackHeaderTooShort,
@@ -73,7 +87,23 @@ enum MidiErrorCode
    MidiError_MetaEventOnInput,
 
    MidiError_RequestedTempoFromNonTempoEvent,
-   MidiError_UnresolvedNoteEvents
+   MidiError_UnresolvedNoteEvents,
+
+   // Tempo editing (see Midi::SetTempoChange)
+   MidiError_BadTempo,
+
+   // Batch loading (see Midi::ReadManyFromFiles)
+   MidiError_OutOfMemory,
+   MidiError_LoadFailed,
+
+   // Precompiled song cache (see MidiCache)
+   MidiError_BadCacheFile,
+   MidiError_StaleCacheFile,
+   MidiError_CacheWriteFailed,
+
+   // SMPTE time division with a frame rate other than 24, 25, 29.97 or 30,
+   // or no ticks per frame (see TempoMap::IsValidTimeDivision)
+   MidiError_UnsupportedSmpteRate
 };
 
 class MidiError : public std::exception
@@ -2,9 +2,12 @@
 #ifndef __MIDI_NOTE_H
 #define __MIDI_NOTE_H
 
+#include <memory>
 #include <set>
+#include <string>
 #include <vector>
 #include "MidiTypes.h"
+#include "MidiArena.h"
 
 // Range of all 128 MIDI notes possible
 typedef unsigned int NoteId;
@@ -21,6 +24,38 @@ enum NoteState
 	UserRolling
 };
 
+// The name of the track an event came from.  Copies share one string
+// instead of each carrying their own: a track hands the same name to
+// every event it builds.  A name never changes once it's made; renaming
+// a track gives it a new one (see MidiTrack::SetTrackName).
+class MidiTrackName
+{
+public:
+	MidiTrackName() { }
+	explicit MidiTrackName(const std::string &name) : m_name(std::make_shared<const std::string>(name)) { }
+
+	const std::string &Text() const
+	{
+		const static std::string NoName;
+		return m_name ? *m_name : NoName;
+	}
+
+	operator const std::string &() const { return Text(); }
+
+	// False for a default constructed name, which nothing shares yet
+	bool IsSet() const { return static_cast<bool>(m_name); }
+
+private:
+	std::shared_ptr<const std::string> m_name;
+};
+
+inline bool operator==(const MidiTrackName &lhs, const MidiTrackName &rhs) { return lhs.Text() == rhs.Text(); }
+inline bool operator==(const MidiTrackName &lhs, const std::string &rhs) { return lhs.Text() == rhs; }
+inline bool operator==(const std::string &lhs, const MidiTrackName &rhs) { return lhs == rhs.Text(); }
+inline bool operator!=(const MidiTrackName &lhs, const MidiTrackName &rhs) { return !(lhs == rhs); }
+inline bool operator!=(const MidiTrackName &lhs, const std::string &rhs) { return !(lhs == rhs); }
+inline bool operator!=(const std::string &lhs, const MidiTrackName &rhs) { return !(lhs == rhs); }
+
 template <class T>
 struct GenericNote
 {
@@ -35,6 +70,11 @@ struct GenericNote
 		if (lhs.note_id < rhs.note_id) return true;
 		if (lhs.note_id > rhs.note_id) return false;
 
+		// Notes pair up per channel, so the same pitch can sound on two
+		// channels at once
+		if (lhs.channel < rhs.channel) return true;
+		if (lhs.channel > rhs.channel) return false;
+
 		if (lhs.track_id < rhs.track_id) return true;
 		if (lhs.track_id > rhs.track_id) return false;
 
@@ -49,6 +89,10 @@ struct GenericNote
 	unsigned char channel;
 	unsigned int bar_id;
 	int velocity;
+
+	// Tempo (microseconds per quarter note) at the note's start.  In SMPTE
+	// files this is always the fixed tempo they're mapped onto: 1,000,000
+	// (1,001,000 at 29.97 drop-frame), see TempoMap.
 	microseconds_t time_unit;
 	std::string track_name;
 
@@ -67,7 +111,51 @@ namespace MidiLS
 typedef GenericNote<microseconds_t> TranslatedNote;
 
 typedef std::set<MidiLS::Note, MidiLS::Note> NoteSet;
-typedef std::set<TranslatedNote, TranslatedNote> TranslatedNoteSet;
+
+// Songs hold tens of thousands of these.  The loader gives the song's
+// translated notes an arena of their own, see MidiArena.
+typedef std::set<TranslatedNote, TranslatedNote, MidiArenaAllocator<TranslatedNote> > TranslatedNoteSet;
+
+// How a track keeps its notes (see MidiTrack::SortedNotes): only what
+// a note doesn't share with the rest of its track, with no strings or
+// pointers, so a track's notes are one flat array that can be copied
+// (or saved, see MidiCache) as a block.
+struct MidiTrackNote
+{
+	// Same order as GenericNote
+	bool operator()(const MidiTrackNote &lhs, const MidiTrackNote &rhs) const
+	{
+		if (lhs.start < rhs.start) return true;
+		if (lhs.start > rhs.start) return false;
+
+		if (lhs.end < rhs.end) return true;
+		if (lhs.end > rhs.end) return false;
+
+		if (lhs.note_id < rhs.note_id) return true;
+		if (lhs.note_id > rhs.note_id) return false;
+
+		if (lhs.channel < rhs.channel) return true;
+		if (lhs.channel > rhs.channel) return false;
+
+		if (lhs.track_id < rhs.track_id) return true;
+		if (lhs.track_id > rhs.track_id) return false;
+
+		return false;
+	}
+
+	unsigned long start;
+	unsigned long end;
+	NoteId note_id;
+	unsigned int track_id;
+
+	unsigned char channel;
+	unsigned char velocity;
+};
+
+// A track's notes in MidiTrackNote order, with no two alike.  Tracks
+// make all their notes at once, so they go straight into an array
+// sized up front and get sorted once.
+typedef std::vector<MidiTrackNote> NoteList;
 
 typedef std::vector<std::string> StrNoteSet;
 
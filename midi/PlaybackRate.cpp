@@ -0,0 +1,55 @@
+#include "PlaybackRate.h"
+
+#include <algorithm>
+
+using namespace std;
+
+void PlaybackRate::SetRate(double rate, microseconds_t ramp_microseconds /* = 0 */)
+{
+	if (!(rate > 0.0)) return;
+
+	m_target_rate = rate;
+
+	if (ramp_microseconds <= 0)
+	{
+		m_rate = rate;
+		m_ramp_slope = 0.0;
+		m_ramp_remaining = 0;
+		return;
+	}
+
+	m_ramp_slope = (rate - m_rate) / static_cast<double>(ramp_microseconds);
+	m_ramp_remaining = ramp_microseconds;
+}
+
+microseconds_t PlaybackRate::Advance(microseconds_t transport_delta)
+{
+	double song = m_carry;
+	microseconds_t remaining = transport_delta;
+
+	if (m_ramp_remaining > 0 && remaining > 0)
+	{
+		const microseconds_t step = min(remaining, m_ramp_remaining);
+
+		// The rate moves in a straight line, so this step covers its
+		// average rate times its length
+		const double end_rate = m_rate + m_ramp_slope * static_cast<double>(step);
+		song += (m_rate + end_rate) * 0.5 * static_cast<double>(step);
+
+		m_ramp_remaining -= step;
+		m_rate = (m_ramp_remaining == 0) ? m_target_rate : end_rate;
+		remaining -= step;
+	}
+
+	song += m_rate * static_cast<double>(remaining);
+
+	const microseconds_t whole = static_cast<microseconds_t>(song);
+	m_carry = song - static_cast<double>(whole);
+
+	return whole;
+}
+
+microseconds_t PlaybackRate::SongToTransport(microseconds_t song_microseconds) const
+{
+	return static_cast<microseconds_t>(static_cast<double>(song_microseconds) / m_rate);
+}
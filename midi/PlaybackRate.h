@@ -0,0 +1,53 @@
+#ifndef __MIDI_PLAYBACK_RATE_H
+#define __MIDI_PLAYBACK_RATE_H
+
+#include "MidiTypes.h"
+
+// Maps transport (wall clock) time onto song time.  1.0 plays at the
+// song's own tempo, 0.5 at half speed.  The rate can jump or ramp
+// linearly to a new value over a stretch of transport time.
+//
+// Only the clock is scaled: event and note times stay in song time, so
+// changing the rate costs nothing however big the song is.  Fractions of
+// a microsecond are carried from one step to the next rather than
+// dropped, so song time never drifts from the integral of the rate.
+class PlaybackRate
+{
+public:
+	PlaybackRate() : m_rate(1.0), m_target_rate(1.0), m_ramp_slope(0.0), m_ramp_remaining(0), m_carry(0.0) { }
+
+	// Rates at or below zero are ignored.  A ramp of 0 changes the rate
+	// right away.
+	void SetRate(double rate, microseconds_t ramp_microseconds = 0);
+
+	// The rate right now (part way through a ramp, if there is one)
+	double Rate() const { return m_rate; }
+
+	// Where the rate is headed (Rate() unless ramping)
+	double TargetRate() const { return m_target_rate; }
+
+	bool IsRamping() const { return m_ramp_remaining > 0; }
+
+	// Song time covered by the next 'transport_delta' of transport time.
+	// Moves any ramp along.
+	microseconds_t Advance(microseconds_t transport_delta);
+
+	// How long a stretch of song time takes to play at the current rate
+	microseconds_t SongToTransport(microseconds_t song_microseconds) const;
+
+	// Drops any carried fraction (the song position was moved)
+	void ResetCarry() { m_carry = 0.0; }
+
+private:
+	double m_rate;
+	double m_target_rate;
+
+	// Rate change per microsecond of transport time while ramping
+	double m_ramp_slope;
+	microseconds_t m_ramp_remaining;
+
+	// Song time owed from earlier steps, always under a microsecond
+	double m_carry;
+};
+
+#endif
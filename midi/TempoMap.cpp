@@ -0,0 +1,340 @@
+#include "TempoMap.h"
+#include "MidiTrack.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// How far a hinted lookup walks forward before deciding it's a seek
+const static size_t TempoMapMaxSteps = 4;
+
+// SMPTE frame rates, as the (negated) high byte of the time division
+const static int SmpteFrames24 = 24;
+const static int SmpteFrames25 = 25;
+const static int SmpteFrames2997 = 29;
+const static int SmpteFrames30 = 30;
+
+// Length of the quarter note SMPTE time is mapped onto
+const static microseconds_t SmpteQuarterNote = 1000000;
+const static microseconds_t SmpteDropFrameQuarterNote = 1001000;
+
+static int smpte_frames(unsigned short time_division)
+{
+	return -static_cast<int>(static_cast<signed char>(time_division >> 8));
+}
+
+static int smpte_ticks_per_frame(unsigned short time_division)
+{
+	return time_division & 0xFF;
+}
+
+bool TempoMap::IsValidTimeDivision(unsigned short time_division)
+{
+	if (!IsSmpte(time_division)) return true;
+
+	switch (smpte_frames(time_division))
+	{
+	case SmpteFrames24:
+	case SmpteFrames25:
+	case SmpteFrames2997:
+	case SmpteFrames30:
+		return smpte_ticks_per_frame(time_division) != 0;
+
+	default:
+		return false;
+	}
+}
+
+unsigned short TempoMap::PulsesPerQuarterNoteOf(unsigned short time_division)
+{
+	if (!IsSmpte(time_division)) return time_division;
+	if (!IsValidTimeDivision(time_division)) return 0;
+
+	// 29.97 drop-frame counts 30 frames to its (1.001 second) quarter note
+	const int frames = smpte_frames(time_division);
+	return static_cast<unsigned short>((frames == SmpteFrames2997 ? 30 : frames) * smpte_ticks_per_frame(time_division));
+}
+
+TempoMap::TempoMap(const MidiTrack &tempo_track, unsigned short time_division) : m_pulses_per_quarter_note(PulsesPerQuarterNoteOf(time_division))
+{
+	if (IsSmpte(time_division))
+	{
+		// Tempo events don't move SMPTE time
+		Segment start = { 0, 0, 0, (smpte_frames(time_division) == SmpteFrames2997) ? SmpteDropFrameQuarterNote : SmpteQuarterNote };
+		m_segments.push_back(start);
+		return;
+	}
+
+	const MidiEventList &events = tempo_track.Events();
+	const MidiEventPulsesList &event_pulses = tempo_track.EventPulses();
+
+	m_segments.reserve(events.size() + 1);
+
+	Segment start = { 0, 0, 0, DefaultTempo };
+	m_segments.push_back(start);
+
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const Segment &previous = m_segments.back();
+
+		Segment segment;
+		segment.pulses = event_pulses[i];
+		segment.scaled_usecs = previous.scaled_usecs + static_cast<microseconds_t>(segment.pulses - previous.pulses) * previous.tempo;
+		segment.usecs = ScaledToMicroseconds(segment.scaled_usecs);
+		segment.tempo = events[i].GetTempoInUsPerQn();
+
+		m_segments.push_back(segment);
+	}
+}
+
+microseconds_t TempoMap::ConvertPulsesToMicroseconds(unsigned long pulses, microseconds_t tempo, unsigned short pulses_per_quarter_note)
+{
+	// Here's what we have to work with:
+	//   pulses is given
+	//   tempo is given (units of microseconds/quarter_note)
+	//   (pulses/quarter_note) is given as a constant in this object file
+	if (pulses_per_quarter_note == 0) return 0;
+	return static_cast<microseconds_t>(pulses) * tempo / pulses_per_quarter_note;
+}
+
+microseconds_t TempoMap::ScaledToMicroseconds(microseconds_t scaled_usecs) const
+{
+	if (m_pulses_per_quarter_note == 0) return 0;
+	return scaled_usecs / m_pulses_per_quarter_note;
+}
+
+size_t TempoMap::FindSegment(unsigned long pulses) const
+{
+	// A tempo change lands *after* anything at exactly its pulse, so we
+	// want the last segment starting strictly before 'pulses' (or the
+	// very first one).
+	vector<Segment>::const_iterator next = lower_bound(m_segments.begin(), m_segments.end(), pulses,
+		[](const Segment &segment, unsigned long p) { return segment.pulses < p; });
+
+	return (next == m_segments.begin()) ? 0 : (next - m_segments.begin()) - 1;
+}
+
+microseconds_t TempoMap::PulsesToMicroseconds(unsigned long pulses) const
+{
+	if (m_segments.empty()) return 0;
+
+	const Segment &segment = m_segments[FindSegment(pulses)];
+	return ScaledToMicroseconds(segment.scaled_usecs + static_cast<microseconds_t>(pulses - segment.pulses) * segment.tempo);
+}
+
+microseconds_t TempoMap::PulsesToMicroseconds(unsigned long pulses, size_t &hint) const
+{
+	if (m_segments.empty()) return 0;
+
+	// Walk forward a few changes from last time before giving up and
+	// searching (see FindSegment for which segment a pulse is in)
+	bool found = false;
+	if (hint < m_segments.size() && (hint == 0 || m_segments[hint].pulses < pulses))
+	{
+		for (size_t step = 0; step < TempoMapMaxSteps; ++step)
+		{
+			if (hint + 1 == m_segments.size() || pulses <= m_segments[hint + 1].pulses)
+			{
+				found = true;
+				break;
+			}
+
+			++hint;
+		}
+	}
+
+	if (!found) hint = FindSegment(pulses);
+
+	const Segment &segment = m_segments[hint];
+	return ScaledToMicroseconds(segment.scaled_usecs + static_cast<microseconds_t>(pulses - segment.pulses) * segment.tempo);
+}
+
+// The inner loop of the bulk conversion: every pulse here is in the same
+// tempo segment, so each one is the same multiply, add and divide with
+// nothing to look up.
+static void convert_run(const unsigned long *pulses, size_t count, microseconds_t origin, microseconds_t tempo,
+	microseconds_t pulses_per_quarter_note, microseconds_t *usecs)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		usecs[i] = (origin + static_cast<microseconds_t>(pulses[i]) * tempo) / pulses_per_quarter_note;
+	}
+}
+
+void TempoMap::PulsesToMicroseconds(const unsigned long *pulses, size_t count, microseconds_t *usecs) const
+{
+	if (count == 0) return;
+
+	if (m_segments.empty() || m_pulses_per_quarter_note == 0)
+	{
+		fill(usecs, usecs + count, 0);
+		return;
+	}
+
+	size_t current = FindSegment(pulses[0]);
+	size_t i = 0;
+	while (i < count)
+	{
+		// Sorted pulses just step on through the tempo changes, so a
+		// whole sorted list is one pass over both (O(pulses + changes)).
+		// Only a pulse earlier than the one before it needs a search.
+		if (i > 0 && pulses[i] < pulses[i - 1]) current = FindSegment(pulses[i]);
+		else while (current + 1 < m_segments.size() && m_segments[current + 1].pulses < pulses[i]) ++current;
+
+		const Segment &segment = m_segments[current];
+
+		// The run is every following pulse that is in order and still in
+		// this segment
+		const bool last = (current + 1 == m_segments.size());
+		const unsigned long segment_end = last ? 0 : m_segments[current + 1].pulses;
+
+		size_t run_end = i + 1;
+		while (run_end < count && pulses[run_end] >= pulses[run_end - 1] && (last || pulses[run_end] <= segment_end)) ++run_end;
+
+		// Time at pulse 0 if this tempo had been in effect from the start
+		// (may be negative; the sum for any pulse in the segment isn't)
+		const microseconds_t origin = segment.scaled_usecs - static_cast<microseconds_t>(segment.pulses) * segment.tempo;
+		convert_run(pulses + i, run_end - i, origin, segment.tempo, m_pulses_per_quarter_note, usecs + i);
+
+		i = run_end;
+	}
+}
+
+unsigned long TempoMap::MicrosecondsToPulses(microseconds_t usecs) const
+{
+	if (m_segments.empty() || m_pulses_per_quarter_note == 0 || usecs <= 0) return 0;
+
+	// Several tempo changes on one pulse all start at the same time; the
+	// last of them is the one actually in effect.
+	vector<Segment>::const_iterator next = upper_bound(m_segments.begin(), m_segments.end(), usecs,
+		[](microseconds_t u, const Segment &segment) { return u < segment.usecs; });
+
+	const Segment &segment = *(next - 1);
+	if (segment.tempo <= 0) return segment.pulses;
+
+	// Largest k with (scaled_usecs + k * tempo) / ppq <= usecs, i.e.
+	// scaled_usecs + k * tempo < (usecs + 1) * ppq
+	const microseconds_t room = (usecs + 1) * m_pulses_per_quarter_note - segment.scaled_usecs - 1;
+	unsigned long pulses = segment.pulses + static_cast<unsigned long>(room / segment.tempo);
+
+	if (next != m_segments.end() && pulses > next->pulses) pulses = next->pulses;
+
+	return pulses;
+}
+
+bool TempoMap::FindShift(const TempoMap &previous, unsigned long &shift_from, microseconds_t &delta) const
+{
+	if (m_pulses_per_quarter_note == 0 || m_pulses_per_quarter_note != previous.m_pulses_per_quarter_note) return false;
+
+	// Walk back over the tempo changes both maps end with
+	size_t current = m_segments.size();
+	size_t old = previous.m_segments.size();
+	while (current > 0 && old > 0)
+	{
+		const Segment &segment = m_segments[current - 1];
+		const Segment &old_segment = previous.m_segments[old - 1];
+		if (segment.pulses != old_segment.pulses || segment.tempo != old_segment.tempo) break;
+
+		--current;
+		--old;
+	}
+
+	if (current == m_segments.size()) return false;
+
+	// Everything from that segment on is the same sum plus this much,
+	// which only survives the rounding unchanged in whole microseconds
+	const microseconds_t scaled_delta = m_segments[current].scaled_usecs - previous.m_segments[old].scaled_usecs;
+	if (scaled_delta % m_pulses_per_quarter_note != 0) return false;
+
+	shift_from = m_segments[current].pulses;
+	delta = scaled_delta / m_pulses_per_quarter_note;
+	return true;
+}
+
+vector<TempoMap::Segment>::iterator TempoMap::FindChange(unsigned long pulses)
+{
+	// The first segment is the default tempo, not a change
+	return lower_bound(m_segments.begin() + 1, m_segments.end(), pulses,
+		[](const Segment &segment, unsigned long p) { return segment.pulses < p; });
+}
+
+void TempoMap::SumFrom(size_t first)
+{
+	for (size_t i = max<size_t>(first, 1); i < m_segments.size(); ++i)
+	{
+		const Segment &previous = m_segments[i - 1];
+		Segment &segment = m_segments[i];
+
+		segment.scaled_usecs = previous.scaled_usecs + static_cast<microseconds_t>(segment.pulses - previous.pulses) * previous.tempo;
+		segment.usecs = ScaledToMicroseconds(segment.scaled_usecs);
+	}
+}
+
+void TempoMap::SetTempo(unsigned long pulses, microseconds_t tempo)
+{
+	if (m_segments.empty()) return;
+
+	vector<Segment>::iterator change = FindChange(pulses);
+	if (change != m_segments.end() && change->pulses == pulses)
+	{
+		change->tempo = tempo;
+
+		// Its own start time stays, the ones after it don't
+		SumFrom(change - m_segments.begin() + 1);
+		return;
+	}
+
+	Segment segment = { pulses, 0, 0, tempo };
+	change = m_segments.insert(change, segment);
+	SumFrom(change - m_segments.begin());
+}
+
+bool TempoMap::RemoveTempo(unsigned long pulses)
+{
+	if (m_segments.empty()) return false;
+
+	vector<Segment>::iterator change = FindChange(pulses);
+	if (change == m_segments.end() || change->pulses != pulses) return false;
+
+	change = m_segments.erase(change);
+	SumFrom(change - m_segments.begin());
+	return true;
+}
+
+microseconds_t TempoMap::TempoAtMicroseconds(microseconds_t usecs) const
+{
+	size_t hint = 0;
+	return TempoAtMicroseconds(usecs, hint);
+}
+
+microseconds_t TempoMap::TempoAtMicroseconds(microseconds_t usecs, size_t &hint) const
+{
+	// No tempo changes at all
+	if (m_segments.empty()) return DefaultTempo;
+	if (m_segments.size() < 2) return m_segments.front().tempo;
+
+	// Before the first change we already use its tempo
+	const Segment &first_change = m_segments[1];
+	if (usecs < first_change.usecs)
+	{
+		hint = 1;
+		return first_change.tempo;
+	}
+
+	// Walk forward a few changes from last time before giving up and
+	// searching
+	if (hint >= 1 && hint < m_segments.size() && m_segments[hint].usecs <= usecs)
+	{
+		for (size_t step = 0; step < TempoMapMaxSteps; ++step)
+		{
+			if (hint + 1 >= m_segments.size() || usecs < m_segments[hint + 1].usecs) return m_segments[hint].tempo;
+			++hint;
+		}
+	}
+
+	vector<Segment>::const_iterator next = upper_bound(m_segments.begin() + 1, m_segments.end(), usecs,
+		[](microseconds_t u, const Segment &segment) { return u < segment.usecs; });
+
+	hint = (next - m_segments.begin()) - 1;
+	return m_segments[hint].tempo;
+}
@@ -0,0 +1,132 @@
+#ifndef __MIDI_TEMPO_MAP_H
+#define __MIDI_TEMPO_MAP_H
+
+#include <cstddef>
+#include <vector>
+
+#include "MidiTypes.h"
+
+class MidiTrack;
+
+// The song's tempo changes, each with the wall-clock time it happens at
+// already summed up.  Built once from the tempo track; after that any
+// pulse converts to microseconds with a binary search over the tempo
+// changes instead of a walk through all of them.
+//
+// All the arithmetic is in 64-bit integers.  Times are summed exactly in
+// units of 1/ppq microseconds (pulses * microseconds per quarter note)
+// and only rounded, down, once at the very end, so nothing drifts however
+// many tempo changes there are and every platform gets the same answer.
+// That holds for songs up to 2^63 / ppq microseconds long (over 78 hours
+// at the largest ppq a file can have).
+class TempoMap
+{
+public:
+	const static microseconds_t DefaultTempo = 500000;
+
+	TempoMap() : m_pulses_per_quarter_note(0) { }
+
+	// 'tempo_track' holds only tempo change events, in pulse order (see
+	// Midi::BuildTempoTrack).  'time_division' is the one from the file
+	// header (see PulsesPerQuarterNoteOf).
+	TempoMap(const MidiTrack &tempo_track, unsigned short time_division);
+
+	unsigned short PulsesPerQuarterNote() const { return m_pulses_per_quarter_note; }
+
+	// A file's time division is either pulses per quarter note or, with
+	// the top bit set, SMPTE time: frames per second (negated, in the high
+	// byte) and ticks per frame.  SMPTE ticks are a fixed length whatever
+	// the tempo events say, so they map onto one fixed tempo of a quarter
+	// note per second (per 1.001 seconds at 29.97 drop-frame) with
+	// frames * ticks pulses per quarter note, and convert the same way.
+	static bool IsSmpte(unsigned short time_division) { return (time_division & 0x8000) != 0; }
+
+	// False for SMPTE frame rates other than 24, 25, 29.97 and 30 or no
+	// ticks per frame
+	static bool IsValidTimeDivision(unsigned short time_division);
+
+	static unsigned short PulsesPerQuarterNoteOf(unsigned short time_division);
+
+	microseconds_t PulsesToMicroseconds(unsigned long pulses) const;
+
+	// The same, for pulses that mostly move forward: 'hint' remembers
+	// which tempo change it was under last (start it at 0), the way
+	// TempoAtMicroseconds's does
+	microseconds_t PulsesToMicroseconds(unsigned long pulses, size_t &hint) const;
+
+	// Converts 'count' pulses at once, writing into 'usecs'.  When the
+	// pulses are in order (as a track's EventPulses() are) this is one
+	// sweep over them and the tempo changes together instead of a search
+	// per pulse, and each stretch of pulses under one tempo converts in a
+	// tight loop with no lookups or branches.  Out of order pulses still
+	// convert correctly, just with a search wherever the order breaks.
+	void PulsesToMicroseconds(const unsigned long *pulses, size_t count, microseconds_t *usecs) const;
+
+	// The inverse: the last pulse that has started by song time 'usecs'
+	// (so PulsesToMicroseconds of the result is never after 'usecs').
+	// Anything before the start of the song is pulse 0.
+	unsigned long MicrosecondsToPulses(microseconds_t usecs) const;
+
+	// Tempo (microseconds per quarter note) in effect at song time
+	// 'usecs'.  Before the first tempo change this is the first change's
+	// tempo, and DefaultTempo (or the SMPTE tempo) if there are none.
+	microseconds_t TempoAtMicroseconds(microseconds_t usecs) const;
+
+	// The same, for times that mostly move forward: 'hint' remembers
+	// which tempo change it found last (start it at 0), so the next
+	// lookup a little further on is O(1) instead of a search.
+	microseconds_t TempoAtMicroseconds(microseconds_t usecs, size_t &hint) const;
+
+	// For comparing against the map from before a tempo edit: finds the
+	// pulse past which every time in this map is exactly the time in
+	// 'previous' plus 'delta' whole microseconds (the tempo changes from
+	// there on being the same in both).  False if the two never line up
+	// again, or only up to a fraction of a microsecond.
+	bool FindShift(const TempoMap &previous, unsigned long &shift_from, microseconds_t &delta) const;
+
+	// Tempo editing, the same way Midi::SetTempoChange edits the tempo
+	// track: SetTempo changes the first tempo change at 'pulses' or puts
+	// one in there, and RemoveTempo takes it out (false if there wasn't
+	// one).  Only the start times from there on are summed again.  These
+	// are for tempo maps of pulses per quarter note; SMPTE time doesn't
+	// have tempo changes.
+	void SetTempo(unsigned long pulses, microseconds_t tempo);
+	bool RemoveTempo(unsigned long pulses);
+
+	// 'pulses' at a single tempo, rounded down
+	static microseconds_t ConvertPulsesToMicroseconds(unsigned long pulses, microseconds_t tempo, unsigned short pulses_per_quarter_note);
+
+private:
+	friend class MidiCache;
+
+	// One per tempo change, plus one at the very start for the default
+	// tempo.  SMPTE time only has that first one.
+	struct Segment
+	{
+		unsigned long pulses;
+
+		// Exact start time, in 1/ppq microseconds
+		microseconds_t scaled_usecs;
+
+		// The same, rounded down to whole microseconds
+		microseconds_t usecs;
+
+		microseconds_t tempo;
+	};
+
+	// Index of the segment 'pulses' falls in
+	size_t FindSegment(unsigned long pulses) const;
+
+	// The first segment for a tempo change at 'pulses' or later
+	std::vector<Segment>::iterator FindChange(unsigned long pulses);
+
+	// Sums the start times of the segments from 'first' on again
+	void SumFrom(size_t first);
+
+	microseconds_t ScaledToMicroseconds(microseconds_t scaled_usecs) const;
+
+	std::vector<Segment> m_segments;
+	unsigned short m_pulses_per_quarter_note;
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "TimelineCursor.h"
+#include "Midi.h"
+
+#include <algorithm>
+
+using namespace std;
+
+// How far the meter lookup walks forward before deciding it's a seek
+const static size_t TimelineCursorMaxSteps = 4;
+
+TimelineCursor::TimelineCursor()
+{
+	Reset();
+}
+
+void TimelineCursor::Reset()
+{
+	m_position = 0;
+
+	m_tempo = TempoMap::DefaultTempo;
+	m_meter_amount = 0;
+	m_meter_unit = 0;
+	m_bar_id = 0;
+	m_meter_id = 0;
+
+	m_tempo_hint = 0;
+	m_meter_index = 0;
+	m_bars.Reset();
+}
+
+void TimelineCursor::Seek(const Midi &midi, microseconds_t time /* = -1 */)
+{
+	if (time == -1)
+	{
+		time = midi.m_microsecond_song_position;
+	}
+	m_position = time;
+
+	m_tempo = midi.m_tempo_map.TempoAtMicroseconds(time, m_tempo_hint);
+
+	SeekMeter(midi);
+
+	if (midi.m_beat_grid.Empty())
+	{
+		m_bar_id = 0;
+		m_meter_id = 0;
+	}
+	else
+	{
+		m_bars.FindBarAndMeter(midi, time, m_bar_id, m_meter_id);
+	}
+}
+
+void TimelineCursor::SeekMeter(const Midi &midi)
+{
+	m_meter_amount = 0;
+	m_meter_unit = 0;
+
+	if (midi.m_tracks.size() <= 2) return;
+
+	const MidiTrack &meter_track = midi.m_tracks[midi.m_tracks.size() - 2];
+	const MidiEventList &events = meter_track.Events();
+	const MidiEventMicrosecondList &usecs = meter_track.EventUsecs();
+	if (events.empty() || usecs.size() != events.size()) return;
+
+	// The meter of the last change at or before now, and the first
+	// change's meter before any of them
+	bool found = false;
+	if (m_meter_index < usecs.size() && usecs[m_meter_index] <= m_position)
+	{
+		for (size_t step = 0; step < TimelineCursorMaxSteps; ++step)
+		{
+			if (m_meter_index + 1 >= usecs.size() || m_position < usecs[m_meter_index + 1])
+			{
+				found = true;
+				break;
+			}
+			++m_meter_index;
+		}
+	}
+
+	if (!found)
+	{
+		const size_t next = upper_bound(usecs.begin(), usecs.end(), m_position) - usecs.begin();
+		m_meter_index = (next == 0) ? 0 : next - 1;
+	}
+
+	const MidiEvent &ev = events[m_meter_index];
+	m_meter_amount = ev.BeatMember();
+	m_meter_unit = ev.BeatDenominator();
+}
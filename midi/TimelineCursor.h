@@ -0,0 +1,62 @@
+#ifndef __MIDI_TIMELINE_CURSOR_H
+#define __MIDI_TIMELINE_CURSOR_H
+
+#include <cstddef>
+
+#include "MidiTypes.h"
+#include "MidiBarCursor.h"
+
+class Midi;
+
+// Everything about "where are we" in a song at once: tempo, meter, bar
+// and beat.  Keeps hold of the tempo change, meter change, bar and beat
+// it was last in, so moving forward a little (a playback tick) updates
+// them all in O(1).  Seeks fall back to binary searches.
+//
+// Each answer is the same as the matching Midi method would give for
+// the last position passed to Seek().  Like MidiBarCursor it keeps no
+// reference to the song; pass the same one every time.
+class TimelineCursor
+{
+public:
+	TimelineCursor();
+
+	void Reset();
+
+	// Moves the cursor to song time 'time' (-1 for the song's current
+	// position)
+	void Seek(const Midi &midi, microseconds_t time = -1);
+
+	microseconds_t Position() const { return m_position; }
+
+	// Same as GetSongRunningTempoMicroseconds(Position())
+	microseconds_t Tempo() const { return m_tempo; }
+
+	// Same as GetRealTimeMeter(amount, unit, Position()), or 0/0 when the
+	// song has no meter track
+	unsigned int MeterAmount() const { return m_meter_amount; }
+	unsigned int MeterUnit() const { return m_meter_unit; }
+
+	// Same as GetSongBarIDAndMeterID(bar_id, meter_id, Position()), or
+	// 0/0 when the song has no bars
+	int BarId() const { return m_bar_id; }
+	int MeterId() const { return m_meter_id; }
+
+private:
+	void SeekMeter(const Midi &midi);
+
+	microseconds_t m_position;
+
+	microseconds_t m_tempo;
+	unsigned int m_meter_amount;
+	unsigned int m_meter_unit;
+	int m_bar_id;
+	int m_meter_id;
+
+	// Where each lookup left off
+	size_t m_tempo_hint;
+	size_t m_meter_index;
+	MidiBarCursor m_bars;
+};
+
+#endif